@@ -2,6 +2,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <math.h>
 #include "msvcint.h"
 
@@ -14,6 +15,11 @@
 
 #define ENCODE_MAXSIZE 0x1000000
 #define ENCODE_DEEPLEVEL 64
+#define ENCODE_NESTLEVEL 1024
+#define ENCODE_CHUNKSIZE 0x4000
+#define ENCODE_BULKSIZE 256
+
+#define BLOB_METATABLE "sproto.blob"
 
 #ifndef luaL_newlib /* using LuaJIT */
 /*
@@ -45,6 +51,8 @@ LUALIB_API void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 #if LUA_VERSION_NUM < 503
 
 #if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+
 static int64_t lua_tointegerx(lua_State *L, int idx, int *isnum) {
 	if (lua_isnumber(L, idx)) {
 		if (isnum) *isnum = 1;
@@ -120,8 +128,21 @@ struct encode_ud {
 	int array_index;			// ǰеarraylua index
 	int deep;					// ṹǶ
 	int iter_index;
+	int error_index;			// the error of the callback, raised after the engine returns
 };
 
+// record the error and stop the engine, lencode raises it when the engine has freed its frame stack
+static int
+encode_error(struct encode_ud *self, const char *fmt, ...) {
+	lua_State *L = self->L;
+	va_list argp;
+	va_start(argp, fmt);
+	lua_pushvfstring(L, fmt, argp);
+	va_end(argp);
+	lua_replace(L, self->error_index);
+	return SPROTO_CB_ERROR;
+}
+
 /*
 	ã
 		encode_udtagname, indexӽűȡһֵvalue
@@ -142,12 +163,156 @@ struct encode_ud {
 	أ
 		ռÿռ
 */
+// the encoded struct in a blob made by sproto.blob, or NULL
+static const char *
+toblob(lua_State *L, int index, size_t *sz) {
+	const char * code = NULL;
+	if (lua_getmetatable(L, index)) {
+		luaL_getmetatable(L, BLOB_METATABLE);
+		if (lua_rawequal(L, -1, -2)) {
+			lua_rawgeti(L, index, 1);
+			code = lua_tolstring(L, -1, sz);
+			lua_pop(L, 1);	// the string is kept by the blob
+		}
+		lua_pop(L, 2);
+	}
+	return code;
+}
+
+// copy the bytes into the encoding message
+static int
+encode_bytes(struct encode_ud *self, const struct sproto_arg *args, const char *str, size_t sz) {
+	if (args->value == NULL) {
+		// sproto_encode_size
+		return sz;
+	}
+	if (sz > args->length) {
+		if (args->writer == NULL)
+			return SPROTO_CB_ERROR;
+		// no room in current chunk, append it to the writer
+		if (sproto_writer_write(args->writer, str, sz) < 0)
+			return encode_error(self, "Out of memory");
+		return sz;
+	}
+	memcpy(args->value, str, sz);
+	return sz;
+}
+
+static int
+tointeger(struct encode_ud *self, const struct sproto_arg *args, lua_Integer index, int64_t *v) {
+	lua_State *L = self->L;
+	if (args->extra) {
+		// It's decimal.
+		lua_Number vn = lua_tonumber(L, -1);
+		// use 64bit integer for 32bit architecture.
+		*v = (int64_t)(round(vn * args->extra));
+	} else {
+		int isnum;
+		*v = lua_tointegerx(L, -1, &isnum);
+		if(!isnum) {
+			return encode_error(self, ".%s[%d] is not an integer (Is a %s)", 
+				args->tagname, (int)index, lua_typename(L, lua_type(L, -1)));
+		}
+	}
+	return 0;
+}
+
+/*
+	fill the span of a bulk array from args->index, use raw access as the array is a plain sequence.
+	returns the number of elements, less than the span at the end of array.
+ */
+static int
+encode_bulk(lua_State *L, struct encode_ud *self, const struct sproto_arg *args) {
+	lua_Integer len = (lua_Integer)lua_rawlen(L, self->array_index);
+	lua_Integer index = args->index;
+	int cap = args->type == SPROTO_TINTEGER ? args->length / (int)sizeof(int64_t) : args->length;
+	int n;
+	if (args->type == SPROTO_TINTEGER && args->extra) {
+		// decimal : read the numbers first, and scale them in one loop
+		lua_Number vn[ENCODE_BULKSIZE];
+		int64_t * v = (int64_t *)args->value;
+		int i;
+		if (cap > ENCODE_BULKSIZE)
+			cap = ENCODE_BULKSIZE;
+		for (n=0;n<cap && index<=len;n++,index++) {
+			lua_rawgeti(L, self->array_index, index);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L,1);
+				break;
+			}
+			vn[n] = lua_tonumber(L, -1);
+			lua_pop(L,1);
+		}
+		for (i=0;i<n;i++) {
+			v[i] = (int64_t)(round(vn[i] * args->extra));
+		}
+		return n;
+	}
+	for (n=0;n<cap && index<=len;n++,index++) {
+		lua_rawgeti(L, self->array_index, index);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L,1);
+			break;
+		}
+		if (args->type == SPROTO_TINTEGER) {
+			if (tointeger(self, args, index, (int64_t *)args->value + n))
+				return SPROTO_CB_ERROR;
+		} else {
+			if (!lua_isboolean(L,-1)) {
+				return encode_error(self, ".%s[%d] is not a boolean (Is a %s)",
+					args->tagname, (int)index, lua_typename(L, lua_type(L, -1)));
+			}
+			((uint8_t *)args->value)[n] = (uint8_t)lua_toboolean(L, -1);
+		}
+		lua_pop(L,1);
+	}
+	return n;
+}
+
+/*
+	walk into the struct (at top) in the nested engine,
+	the state of the parent is saved on the stack after it.
+ */
+static int
+encode_begin(struct encode_ud *self, int top) {
+	lua_State *L = self->L;
+	// a cyclic table walks until here
+	if (self->deep >= ENCODE_NESTLEVEL)
+		return encode_error(self, "The table is too deep");
+	if (!lua_checkstack(L, 8))
+		return encode_error(self, "stack overflow");
+	++self->deep;
+	lua_pushinteger(L, self->tbl_index);
+	lua_pushinteger(L, self->array_index);
+	lua_pushlightuserdata(L, (void *)self->array_tag);
+	lua_pushinteger(L, self->iter_index);
+	lua_pushnil(L);	// prepare an iterator slot
+	self->tbl_index = top;
+	self->array_tag = NULL;
+	self->array_index = 0;
+	self->iter_index = lua_gettop(L);
+	return SPROTO_CB_NEST;
+}
+
+static int
+encode_end(struct encode_ud *self) {
+	lua_State *L = self->L;
+	int top = self->tbl_index;
+	self->tbl_index = (int)lua_tointeger(L, top+1);
+	self->array_index = (int)lua_tointeger(L, top+2);
+	self->array_tag = (const char *)lua_touserdata(L, top+3);
+	self->iter_index = (int)lua_tointeger(L, top+4);
+	--self->deep;
+	lua_settop(L, top-1);	// pop the value
+	return 0;
+}
+
 static int
 encode(const struct sproto_arg *args) {
 	struct encode_ud *self = (struct encode_ud *)args->ud;
 	lua_State *L = self->L;
-	if (self->deep >= ENCODE_DEEPLEVEL)
-		return luaL_error(L, "The table is too deep");
+	if (args->nest < 0)
+		return encode_end(self);
 	if (args->index > 0) {
 		if (args->tagname != self->array_tag) {
 			// ǵǰ飬˵self->array_indexҪ
@@ -164,7 +329,7 @@ encode(const struct sproto_arg *args) {
 				return SPROTO_CB_NOARRAY;
 			}
 			if (!lua_istable(L, -1)) {
-				return luaL_error(L, ".*%s(%d) should be a table (Is a %s)",
+				return encode_error(self, ".*%s(%d) should be a table (Is a %s)",
 					args->tagname, args->index, lua_typename(L, lua_type(L, -1)));
 			}
 			if (self->array_index) {
@@ -188,6 +353,14 @@ encode(const struct sproto_arg *args) {
 			lua_insert(L, -2);
 			lua_replace(L, self->iter_index);
 		} else {
+			if (args->bulk)
+				return encode_bulk(L, self, args);
+			if (args->index == 1 && (args->type == SPROTO_TINTEGER || args->type == SPROTO_TBOOLEAN)) {
+				// a plain sequence (no metatable) of integer or boolean is encoded in bulk
+				if (!lua_getmetatable(L, self->array_index))
+					return SPROTO_CB_BULK;
+				lua_pop(L,1);
+			}
 			lua_geti(L, self->array_index, args->index);
 		}
 	} else {
@@ -203,19 +376,8 @@ encode(const struct sproto_arg *args) {
 	case SPROTO_TINTEGER: {
 		int64_t v;
 		lua_Integer vh;
-		int isnum;
-		if (args->extra) {
-			// It's decimal.
-			lua_Number vn = lua_tonumber(L, -1);
-			// use 64bit integer for 32bit architecture.
-			v = (int64_t)(round(vn * args->extra));
-		} else {
-			v = lua_tointegerx(L, -1, &isnum);
-			if(!isnum) {
-				return luaL_error(L, ".%s[%d] is not an integer (Is a %s)", 
-					args->tagname, args->index, lua_typename(L, lua_type(L, -1)));
-			}
-		}
+		if (tointeger(self, args, args->index, &v))
+			return SPROTO_CB_ERROR;
 		lua_pop(L,1);
 		// notice: in lua 5.2, lua_Integer maybe 52bit
 		vh = v >> 31;
@@ -231,7 +393,7 @@ encode(const struct sproto_arg *args) {
 	case SPROTO_TBOOLEAN: {
 		int v = lua_toboolean(L, -1);
 		if (!lua_isboolean(L,-1)) {
-			return luaL_error(L, ".%s[%d] is not a boolean (Is a %s)",
+			return encode_error(self, ".%s[%d] is not a boolean (Is a %s)",
 				args->tagname, args->index, lua_typename(L, lua_type(L, -1)));
 		}
 		*(int *)args->value = v;
@@ -241,26 +403,41 @@ encode(const struct sproto_arg *args) {
 	case SPROTO_TSTRING: {
 		size_t sz = 0;
 		const char * str;
+		int r;
 		if (!lua_isstring(L, -1)) {
-			return luaL_error(L, ".%s[%d] is not a string (Is a %s)", 
+			return encode_error(self, ".%s[%d] is not a string (Is a %s)", 
 				args->tagname, args->index, lua_typename(L, lua_type(L, -1)));
 		} else {
 			str = lua_tolstring(L, -1, &sz);
 		}
-		if (sz > args->length)
-			return SPROTO_CB_ERROR;
-		memcpy(args->value, str, sz);
+		r = encode_bytes(self, args, str, sz);
 		lua_pop(L,1);
-		return sz;
+		return r;
 	}
 	case SPROTO_TSTRUCT: {
 		struct encode_ud sub;
 		int r;
 		int top = lua_gettop(L);
+		size_t sz;
+		const char * code;
 		if (!lua_istable(L, top)) {
-			return luaL_error(L, ".%s[%d] is not a table (Is a %s)", 
+			return encode_error(self, ".%s[%d] is not a table (Is a %s)", 
 				args->tagname, args->index, lua_typename(L, lua_type(L, -1)));
 		}
+		code = toblob(L, top, &sz);
+		if (code) {
+			// splice the pre-encoded struct
+			r = encode_bytes(self, args, code, sz);
+			lua_settop(L, top-1);
+			return r;
+		}
+		if (args->nest)
+			return encode_begin(self, top);
+		if (self->deep + 1 >= ENCODE_DEEPLEVEL) {
+			if (args->writer)
+				return SPROTO_CB_ERROR;	// lencode retries with the nested engine
+			return encode_error(self, "The table is too deep");
+		}
 		sub.L = L;
 		sub.st = args->subtype;
 		sub.tbl_index = top;
@@ -269,14 +446,22 @@ encode(const struct sproto_arg *args) {
 		sub.deep = self->deep + 1;
 		lua_pushnil(L);	// prepare an iterator slot
 		sub.iter_index = sub.tbl_index + 1;
-		r = sproto_encode(args->subtype, args->value, args->length, encode, &sub);
+		sub.error_index = self->error_index;
+		if (args->writer) {
+			r = sproto_encode_writer(args->subtype, args->writer, encode, &sub);
+		} else if (args->value == NULL) {
+			// sproto_encode_size
+			r = sproto_encode_size(args->subtype, encode, &sub);
+		} else {
+			r = sproto_encode(args->subtype, args->value, args->length, encode, &sub);
+		}
 		lua_settop(L, top-1);	// pop the value
 		if (r < 0) 
 			return SPROTO_CB_ERROR;
 		return r;
 	}
 	default:
-		return luaL_error(L, "Invalid field type %d", args->type);
+		return encode_error(self, "Invalid field type %d", args->type);
 	}
 }
 
@@ -298,6 +483,52 @@ expand_buffer(lua_State *L, int osz, int nsz) {
 	return output;
 }
 
+static void
+encode_init(lua_State *L, struct encode_ud *self, struct sproto_type *st, int tbl_index) {
+	self->L = L;
+	self->st = st;
+	self->tbl_index = tbl_index;
+	self->array_tag = NULL;
+	self->array_index = 0;
+	self->deep = 0;
+
+	lua_settop(L, tbl_index);
+	lua_pushnil(L);	// for the error (stack slot 3)
+	lua_pushnil(L);	// for iterator (stack slot 4)
+	self->error_index = tbl_index+1;
+	self->iter_index = tbl_index+2;
+}
+
+// raise the error the callback recorded, if any
+static void
+encode_raise(lua_State *L, struct encode_ud *self) {
+	if (!lua_isnil(L, self->error_index)) {
+		lua_pushvalue(L, self->error_index);
+		lua_error(L);
+	}
+}
+
+static int
+lwriter_gc(lua_State *L) {
+	struct sproto_writer ** w = (struct sproto_writer **)lua_touserdata(L, 1);
+	sproto_writer_release(*w);
+	*w = NULL;
+	return 0;
+}
+
+static struct sproto_writer *
+encode_writer(lua_State *L) {
+	struct sproto_writer ** w = (struct sproto_writer **)lua_touserdata(L, lua_upvalueindex(3));
+	if (*w == NULL) {
+		*w = sproto_writer_create(ENCODE_CHUNKSIZE);
+		if (*w == NULL)
+			luaL_error(L, "Out of memory");
+	}
+	// it may be dirty after an error
+	sproto_writer_reset(*w);
+	return *w;
+}
+
 /*
 	lightuserdata sproto_type
 	table source
@@ -310,6 +541,7 @@ lencode(lua_State *L) {
 	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
 	int sz = lua_tointeger(L, lua_upvalueindex(2));
 	int tbl_index = 2;
+	int r;
 	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
 	if (st == NULL) {
 		luaL_checktype(L, tbl_index, LUA_TNIL);
@@ -317,167 +549,303 @@ lencode(lua_State *L) {
 		return 1;	// response nil
 	}
 	luaL_checktype(L, tbl_index, LUA_TTABLE);
-	luaL_checkstack(L, ENCODE_DEEPLEVEL*2 + 8, NULL);
-	self.L = L;
-	self.st = st;
-	self.tbl_index = tbl_index;
-	for (;;) {
-		int r;
-		self.array_tag = NULL;
-		self.array_index = 0;
-		self.deep = 0;
+	encode_init(L, &self, st, tbl_index);
+	r = sproto_encode_nested(st, buffer, sz, encode, &self);
+	if (r<0) {
+		// The buffer is too small, encode into the chunked writer (upvalue 3), never restart again.
+		struct sproto_writer * w;
+		encode_raise(L, &self);
+		w = encode_writer(L);
+		luaL_checkstack(L, ENCODE_DEEPLEVEL*2 + 8, NULL);
+		encode_init(L, &self, st, tbl_index);
+		r = sproto_encode_writer(st, w, encode, &self);
+		encode_raise(L, &self);
+		if (r >= 0) {
+			// grow the buffer for the next time, to the size the nested engine needs with the unused
+			// header slots reserved, or a message of this size takes the writer again
+			int bound;
+			encode_init(L, &self, st, tbl_index);
+			bound = sproto_encode_size_nested(st, encode, &self);
+			buffer = expand_buffer(L, sz, bound > r ? bound : r);
+			sproto_writer_copy(w, buffer, r);
+			sproto_writer_reset(w);
+		} else {
+			// too deep for the writer, size it with the nested engine and encode once
+			sproto_writer_reset(w);
+			encode_init(L, &self, st, tbl_index);
+			r = sproto_encode_size_nested(st, encode, &self);
+			if (r < 0) {
+				encode_raise(L, &self);
+				return luaL_error(L, "encode error");
+			}
+			if (r > sz) {
+				buffer = expand_buffer(L, sz, r);
+				sz = lua_tointeger(L, lua_upvalueindex(2));
+			}
+			encode_init(L, &self, st, tbl_index);
+			r = sproto_encode_nested(st, buffer, sz, encode, &self);
+			if (r < 0) {
+				encode_raise(L, &self);
+				return luaL_error(L, "encode error");
+			}
+		}
+	}
+	lua_pushlstring(L, (const char *)buffer, r);
+	return 1;
+}
 
-		lua_settop(L, tbl_index);
-		lua_pushnil(L);	// for iterator (stack slot 3)
-		self.iter_index = tbl_index+1;
+/*
+	lightuserdata sproto_type
+	table source
 
-		r = sproto_encode(st, buffer, sz, encode, &self);
-		if (r<0) {
-			buffer = expand_buffer(L, sz, sz*2);
-			sz *= 2;
-		} else {
-			lua_pushlstring(L, (const char *)buffer, r);
-			return 1;
+	return string (the packed message, the same as sproto.pack(sproto.encode(...)))
+ */
+static int
+lpencode(lua_State *L) {
+	struct encode_ud self;
+	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
+	int sz = lua_tointeger(L, lua_upvalueindex(2));
+	int tbl_index = 2;
+	int r;
+	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
+	if (st == NULL) {
+		luaL_checktype(L, tbl_index, LUA_TNIL);
+		lua_pushstring(L, "");
+		return 1;	// response nil
+	}
+	luaL_checktype(L, tbl_index, LUA_TTABLE);
+	encode_init(L, &self, st, tbl_index);
+	r = sproto_encode_packed(st, buffer, sz, encode, &self);
+	if (r < 0) {
+		// size it once, with the gap of packing in place
+		encode_raise(L, &self);
+		encode_init(L, &self, st, tbl_index);
+		r = sproto_encode_size_nested(st, encode, &self);
+		if (r < 0) {
+			encode_raise(L, &self);
+			return luaL_error(L, "encode error");
+		}
+		buffer = expand_buffer(L, sz, sproto_encode_packed_bound(r));
+		sz = lua_tointeger(L, lua_upvalueindex(2));
+		encode_init(L, &self, st, tbl_index);
+		r = sproto_encode_packed(st, buffer, sz, encode, &self);
+		if (r < 0) {
+			encode_raise(L, &self);
+			return luaL_error(L, "encode error");
 		}
 	}
+	lua_pushlstring(L, (const char *)buffer, r);
+	return 1;
+}
+
+/*
+	lightuserdata sproto_type
+	table source
+
+	return integer (the buffer size sproto.encode needs)
+ */
+static int
+lencodesize(lua_State *L) {
+	struct encode_ud self;
+	int tbl_index = 2;
+	int sz;
+	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
+	if (st == NULL) {
+		luaL_checktype(L, tbl_index, LUA_TNIL);
+		lua_pushinteger(L, 0);
+		return 1;	// response nil
+	}
+	luaL_checktype(L, tbl_index, LUA_TTABLE);
+	encode_init(L, &self, st, tbl_index);
+	sz = sproto_encode_size_nested(st, encode, &self);
+	if (sz < 0) {
+		encode_raise(L, &self);
+		return luaL_error(L, "encode error");
+	}
+	lua_pushinteger(L, sz);
+	return 1;
 }
 
 struct decode_ud {
 	lua_State *L;
-	const char * array_tag;
-	int array_index;
 	int result_index;
-	int deep;
+	int array_index;
 	int mainindex_tag;
 	int key_index;
+	int tables;		// tables can be created, -1 for no limit, -2 after it's exceeded
+	int error_index;	// the error of the callbacks, raised after the engine returns
 };
 
-/*
-	ã
-		encode_udtagname, indexӽűȡһֵvalue
-		encode_ud->tbl_indexָǰSPROTO_TSTRUCTtable
-		ȡӦfieldӦֵtable[tagname]
-		indexжǷһ
-			index > 0ʾΪĿֵΪtable[tagname][index]
-			index = 0Ŀֵtable[tagname]
-	
-		ud:
-		tagname		:Ԫfield
-		type		:Ԫ
-		index		:Ԫ > 0Ԫ = 0
-		st			:typeΪSPROTO_TSTRUCTstӦ
-		value		:ʣ뻺
-		length		:ʣ뻺С
+// the error message at top is raised after the engine has freed its frame stack
+static int
+decode_error(struct decode_ud *self) {
+	lua_replace(self->L, self->error_index);
+	return SPROTO_CB_ERROR;
+}
+
+// set the value at top into the table (or the array) of the struct
+static void
+decode_store(struct decode_ud *self, const struct sproto_arg *args) {
+	lua_State *L = self->L;
+	if (args->index > 0) {
+		lua_seti(L, self->array_index, args->index);
+	} else {
+		if (self->mainindex_tag == args->tagid) {
+			// This tag is marked, save the value to key_index
+			// assert(self->key_index > 0);
+			lua_pushvalue(L,-1);
+			lua_replace(L, self->key_index);
+		}
+		lua_setfield(L, self->result_index, args->tagname);
+	}
+}
 
-	أ
-		ռÿռ
-*/
 static int
-decode(const struct sproto_arg *args) {
+decode_integer(const struct sproto_arg *args, long long v) {
 	struct decode_ud * self = (struct decode_ud *)args->ud;
 	lua_State *L = self->L;
-	if (self->deep >= ENCODE_DEEPLEVEL)
-		return luaL_error(L, "The table is too deep");
-	if (args->index != 0) {
-		// It's array
-		if (args->tagname != self->array_tag) {
-			self->array_tag = args->tagname;
-			lua_newtable(L);
-			lua_pushvalue(L, -1);
-			lua_setfield(L, self->result_index, args->tagname);
-			if (self->array_index) {
-				lua_replace(L, self->array_index);
-			} else {
-				self->array_index = lua_gettop(L);
-			}
-			if (args->index < 0) {
-				// It's a empty array, return now.
-				return 0;
-			}
-		}
+	// notice: in lua 5.2, 52bit integer support (not 64)
+	if (args->extra) {
+		// lua_Integer is 32bit in small lua.
+		lua_Number vn = (lua_Number)v;
+		vn /= args->extra;
+		lua_pushnumber(L, vn);
+	} else {
+		lua_pushinteger(L, v);
 	}
-	switch (args->type) {
-	case SPROTO_TINTEGER: {
-		// notice: in lua 5.2, 52bit integer support (not 64)
-		if (args->extra) {
-			// lua_Integer is 32bit in small lua.
-			int64_t v = *(int64_t*)args->value;
-			lua_Number vn = (lua_Number)v;
-			vn /= args->extra;
-			lua_pushnumber(L, vn);
-		} else {
-			int64_t v = *(int64_t*)args->value;
-			lua_pushinteger(L, v);
-		}
-		break;
+	decode_store(self, args);
+	return 0;
+}
+
+static int
+decode_boolean(const struct sproto_arg *args, int v) {
+	struct decode_ud * self = (struct decode_ud *)args->ud;
+	lua_pushboolean(self->L, v);
+	decode_store(self, args);
+	return 0;
+}
+
+static int
+decode_string(const struct sproto_arg *args, const void *str, int sz) {
+	struct decode_ud * self = (struct decode_ud *)args->ud;
+	lua_pushlstring(self->L, (const char *)str, sz);
+	decode_store(self, args);
+	return 0;
+}
+
+// count the tables created, returns 1 if it exceeds the limit
+static int
+decode_newtable(struct decode_ud *self) {
+	if (self->tables == 0) {
+		self->tables = -2;
+		return 1;
 	}
-	case SPROTO_TBOOLEAN: {
-		int v = *(uint64_t*)args->value;
-		lua_pushboolean(L,v);
-		break;
+	if (self->tables > 0)
+		--self->tables;
+	return 0;
+}
+
+/*
+	walk into the struct, push a new table for it,
+	and the state of the parent is saved on the stack after the table.
+ */
+static int
+decode_struct_begin(const struct sproto_arg *args) {
+	struct decode_ud * self = (struct decode_ud *)args->ud;
+	lua_State *L = self->L;
+	int result;
+	if (decode_newtable(self))
+		return SPROTO_CB_ERROR;
+	if (!lua_checkstack(L, 8)) {
+		lua_pushliteral(L, "stack overflow");
+		return decode_error(self);
 	}
-	case SPROTO_TSTRING: {
-		lua_pushlstring(L, (const char *)args->value, args->length);
-		break;
+	lua_newtable(L);
+	result = lua_gettop(L);
+	lua_pushinteger(L, self->result_index);
+	lua_pushinteger(L, self->array_index);
+	lua_pushinteger(L, self->mainindex_tag);
+	lua_pushinteger(L, self->key_index);
+	self->result_index = result;
+	self->array_index = 0;
+	if (args->mainindex >= 0) {
+		// This struct will set into a map, so mark the main index tag.
+		self->mainindex_tag = args->mainindex;
+		lua_pushnil(L);
+		self->key_index = lua_gettop(L);
+	} else {
+		self->mainindex_tag = -1;
+		self->key_index = 0;
 	}
-	case SPROTO_TSTRUCT: {
-		struct decode_ud sub;
-		int r;
-		lua_newtable(L);
-		sub.L = L;
-		sub.result_index = lua_gettop(L);
-		sub.deep = self->deep + 1;
-		sub.array_index = 0;
-		sub.array_tag = NULL;
-		if (args->mainindex >= 0) {
-			// This struct will set into a map, so mark the main index tag.
-			sub.mainindex_tag = args->mainindex;
-			lua_pushnil(L);
-			sub.key_index = lua_gettop(L);
+	return 0;
+}
 
-			r = sproto_decode(args->subtype, args->value, args->length, decode, &sub);
-			if (r < 0)
-				return SPROTO_CB_ERROR;
-			if (r != args->length)
-				return r;
-			lua_pushvalue(L, sub.key_index);
-			if (lua_isnil(L, -1)) {
-				luaL_error(L, "Can't find main index (tag=%d) in [%s]", args->mainindex, args->tagname);
-			}
-			lua_pushvalue(L, sub.result_index);
-			lua_settable(L, self->array_index);
-			lua_settop(L, sub.result_index-1);
-			return 0;
-		} else {
-			sub.mainindex_tag = -1;
-			sub.key_index = 0;
-			r = sproto_decode(args->subtype, args->value, args->length, decode, &sub);
-			if (r < 0)
-				return SPROTO_CB_ERROR;
-			if (r != args->length)
-				return r;
-			lua_settop(L, sub.result_index);
-			break;
+// the struct is done, restore the parent and set the table into it
+static int
+decode_struct_end(const struct sproto_arg *args) {
+	struct decode_ud * self = (struct decode_ud *)args->ud;
+	lua_State *L = self->L;
+	int result = self->result_index;
+	int key = self->key_index;
+	int map = self->mainindex_tag >= 0;
+	self->result_index = (int)lua_tointeger(L, result+1);
+	self->array_index = (int)lua_tointeger(L, result+2);
+	self->mainindex_tag = (int)lua_tointeger(L, result+3);
+	self->key_index = (int)lua_tointeger(L, result+4);
+	if (map) {
+		lua_pushvalue(L, key);
+		if (lua_isnil(L, -1)) {
+			lua_pushfstring(L, "Can't find main index (tag=%d) in [%s]", args->mainindex, args->tagname);
+			return decode_error(self);
 		}
+		lua_pushvalue(L, result);
+		lua_settable(L, self->array_index);
+	} else {
+		lua_settop(L, result);
+		decode_store(self, args);
 	}
-	default:
-		luaL_error(L, "Invalid type");
+	lua_settop(L, result-1);
+	return 0;
+}
+
+// the array (or the map) is presized and kept at the top until it's done
+static int
+decode_array_begin(const struct sproto_arg *args, int n) {
+	struct decode_ud * self = (struct decode_ud *)args->ud;
+	lua_State *L = self->L;
+	if (decode_newtable(self))
+		return SPROTO_CB_ERROR;
+	if (!lua_checkstack(L, 4)) {
+		lua_pushliteral(L, "stack overflow");
+		return decode_error(self);
 	}
-	if (args->index > 0) {
-		lua_seti(L, self->array_index, args->index);
+	if (args->mainindex >= 0) {
+		lua_createtable(L, 0, n);
 	} else {
-		if (self->mainindex_tag == args->tagid) {
-			// This tag is marked, save the value to key_index
-			// assert(self->key_index > 0);
-			lua_pushvalue(L,-1);
-			lua_replace(L, self->key_index);
-		}
-		lua_setfield(L, self->result_index, args->tagname);
+		lua_createtable(L, n, 0);
 	}
+	self->array_index = lua_gettop(L);
+	return 0;
+}
 
+static int
+decode_array_end(const struct sproto_arg *args) {
+	struct decode_ud * self = (struct decode_ud *)args->ud;
+	lua_setfield(self->L, self->result_index, args->tagname);
+	self->array_index = 0;
 	return 0;
 }
 
+static const struct sproto_visitor decode_visitor = {
+	decode_integer,
+	decode_boolean,
+	decode_string,
+	decode_struct_begin,
+	decode_struct_end,
+	decode_array_begin,
+	decode_array_end,
+};
+
 static const void *
 getbuffer(lua_State *L, int index, size_t *sz) {
 	const void * buffer = NULL;
@@ -496,13 +864,65 @@ getbuffer(lua_State *L, int index, size_t *sz) {
 }
 
 
+#define PROJECTION_METATABLE "sproto.projection"
+
+struct lprojection {
+	struct sproto_type * st;
+	struct sproto_projection p;
+};
+
 /*
 ** luatable, size = sproto.decode(st, msg)
-** decodes a message string generated by sproto.encode with type
+** decodes a message string generated by sproto.encode with type,
+** st can be a projection (sproto.projection) to decode the selected fields only.
+** upvalue 1 is the limits (set by sproto.limit)
 */
+// the type (or the projection) to decode at index
+static struct sproto_type *
+decode_type(lua_State *L, int index, const struct sproto_projection **proj) {
+	if (lua_type(L, index) == LUA_TUSERDATA) {
+		struct lprojection * p = (struct lprojection *)luaL_checkudata(L, index, PROJECTION_METATABLE);
+		*proj = &p->p;
+		return p->st;
+	}
+	*proj = NULL;
+	return (struct sproto_type *)lua_touserdata(L, index);
+}
+
+// the result table is at top, the slot of the error is pushed after it
+static void
+decode_init(lua_State *L, struct decode_ud *self, const struct sproto_limit *limit) {
+	self->L = L;
+	self->result_index = lua_gettop(L);
+	self->array_index = 0;
+	self->mainindex_tag = -1;
+	self->key_index = 0;
+	self->tables = limit->tables > 0 ? limit->tables : -1;
+	lua_pushnil(L);
+	self->error_index = self->result_index + 1;
+}
+
+static int
+decode_result(lua_State *L, struct decode_ud *self, int r) {
+	if (r < 0) {
+		if (!lua_isnil(L, self->error_index)) {
+			lua_pushvalue(L, self->error_index);
+			return lua_error(L);
+		}
+		if (r == -2 || self->tables == -2)
+			return luaL_error(L, "decode error: the message exceeds the limits");
+		return luaL_error(L, "decode error");
+	}
+	lua_settop(L, self->result_index);
+	lua_pushinteger(L, r);
+	return 2;
+}
+
 static int
 ldecode(lua_State *L) {
-	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
+	const struct sproto_limit * limit = (const struct sproto_limit *)lua_touserdata(L, lua_upvalueindex(1));
+	const struct sproto_projection * proj;
+	struct sproto_type * st = decode_type(L, 1, &proj);
 	const void * buffer;
 	struct decode_ud self;
 	size_t sz;
@@ -516,21 +936,103 @@ ldecode(lua_State *L) {
 	if (!lua_istable(L, -1)) { // ջΪһtable
 		lua_newtable(L);
 	}
-	luaL_checkstack(L, ENCODE_DEEPLEVEL*3 + 8, NULL);
-	self.L = L;
-	self.result_index = lua_gettop(L);
-	self.array_index = 0;
-	self.array_tag = NULL;
-	self.deep = 0;
-	self.mainindex_tag = -1;
-	self.key_index = 0;
-	r = sproto_decode(st, buffer, (int)sz, decode, &self);
+	decode_init(L, &self, limit);
+	r = sproto_decode_limit(st, buffer, (int)sz, proj, &decode_visitor, &self, limit);
+	return decode_result(L, &self, r);
+}
+
+// decode the packed message, or the frame made by sproto.frame
+static int
+pdecode(lua_State *L, int framed) {
+	const struct sproto_limit * limit = (const struct sproto_limit *)lua_touserdata(L, lua_upvalueindex(3));
+	const struct sproto_projection * proj;
+	struct sproto_type * st = decode_type(L, 1, &proj);
+	int offset = (int)luaL_optinteger(L, 3, 0);
+	void * output = lua_touserdata(L, lua_upvalueindex(1));
+	int osz = lua_tointeger(L, lua_upvalueindex(2));
+	const uint8_t * buffer;
+	struct decode_ud self;
+	size_t sz = 0;
+	int r;
+	if (st == NULL) {
+		// return nil
+		return 0;
+	}
+	buffer = (const uint8_t *)getbuffer(L, 4, &sz);
+	if (lua_istable(L, 2)) {
+		lua_pushvalue(L, 2);
+	} else {
+		lua_newtable(L);
+	}
+	if (framed) {
+		if (sz < 1 || (buffer[0] != SPROTO_FRAME_PACKED && buffer[0] != SPROTO_FRAME_RAW))
+			return luaL_error(L, "decode error: invalid frame");
+		if (buffer[0] == SPROTO_FRAME_RAW) {
+			if (offset < 0 || offset > (int)sz - 1)
+				return luaL_error(L, "decode error");
+			decode_init(L, &self, limit);
+			r = sproto_decode_limit(st, buffer + 1 + offset, (int)sz - 1 - offset, proj, &decode_visitor, &self, limit);
+			return decode_result(L, &self, r);
+		}
+		++buffer;
+		--sz;
+	}
+	for (;;) {
+		decode_init(L, &self, limit);
+		r = sproto_decode_packed(st, buffer, (int)sz, offset, output, osz, proj, &decode_visitor, &self, limit);
+		if (r != -3)
+			break;
+		// the words are not decoded yet, grow the buffer to the unpacked size (no more than the limit) and retry
+		r = sproto_unpacked_size(buffer, (int)sz);
+		if (limit->unpacked > 0 && r > limit->unpacked)
+			r = limit->unpacked;
+		lua_settop(L, self.result_index);
+		output = expand_buffer(L, osz, r > osz ? r : osz + 1);
+		osz = lua_tointeger(L, lua_upvalueindex(2));
+	}
+	return decode_result(L, &self, r);
+}
+
+/*
+** luatable, size = sproto.pdecode(st, luatable, offset, pack_msg)
+** decodes the message at the unpacked offset of a string packed by sproto.pack, without unpacking it into a string first.
+** luatable (or nil for a new one) receives the result, size is the unpacked size of the message.
+** upvalue 1,2 is the buffer for the unpacked words, upvalue 3 is the limits
+*/
+static int
+lpdecode(lua_State *L) {
+	return pdecode(L, 0);
+}
+
+/*
+** luatable, size = sproto.fdecode(st, luatable, offset, frame)
+** the same as sproto.pdecode, but decodes the frame made by sproto.frame, packed or raw
+*/
+static int
+lfdecode(lua_State *L) {
+	return pdecode(L, 1);
+}
+
+/*
+** size = sproto.verify(st, msg)
+** returns the size of message, or nil if it can't be decoded
+*/
+static int
+lverify(lua_State *L) {
+	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
+	const void * buffer;
+	size_t sz = 0;
+	int r;
+	if (st == NULL) {
+		return luaL_argerror(L, 1, "Need a sproto_type object");
+	}
+	buffer = getbuffer(L, 2, &sz);
+	r = sproto_verify(st, buffer, (int)sz);
 	if (r < 0) {
-		return luaL_error(L, "decode error");
+		return 0;
 	}
-	lua_settop(L, self.result_index);
 	lua_pushinteger(L, r);
-	return 2;
+	return 1;
 }
 
 static int
@@ -552,8 +1054,7 @@ static int
 lpack(lua_State *L) {
 	size_t sz=0;
 	const void * buffer = getbuffer(L, 1, &sz);		// Ŀ
-	// the worst-case space overhead of packing is 2 bytes per 2 KiB of input (256 words = 2KiB).
-	size_t maxsz = (sz + 2047) / 2048 * 2 + sz + 2;
+	int maxsz = sproto_pack_bound((int)sz);
 	void * output = lua_touserdata(L, lua_upvalueindex(1));
 	int bytes;
 	int osz = lua_tointeger(L, lua_upvalueindex(2));
@@ -569,6 +1070,27 @@ lpack(lua_State *L) {
 	return 1;
 }
 
+static int
+unpack_string(lua_State *L, const void * buffer, int sz) {
+	void * output = lua_touserdata(L, lua_upvalueindex(1));
+	int osz = lua_tointeger(L, lua_upvalueindex(2));
+	const struct sproto_limit * limit = (const struct sproto_limit *)lua_touserdata(L, lua_upvalueindex(3));
+	// the size is known before unpacking, so it's unpacked once
+	int r = sproto_unpacked_size(buffer, sz);
+	if (r < 0)
+		return luaL_error(L, "Invalid unpack stream");
+	if (limit->unpacked > 0 && r > limit->unpacked)
+		return luaL_error(L, "unpack error: the size exceeds the limit (%d)", limit->unpacked);
+	if (r > osz) {
+		output = expand_buffer(L, osz, r);
+	}
+	r = sproto_unpack(buffer, sz, output, r);
+	if (r < 0)
+		return luaL_error(L, "Invalid unpack stream");
+	lua_pushlstring(L, (const char *)output, r);
+	return 1;
+}
+
 /*
 ** msg = sproto.unpack(pack_msg)
 ** unpacks the string packed by sproto.pack
@@ -577,21 +1099,84 @@ static int
 lunpack(lua_State *L) {
 	size_t sz=0;
 	const void * buffer = getbuffer(L, 1, &sz);
+	return unpack_string(L, buffer, (int)sz);
+}
+
+/*
+** frame = sproto.frame(threshold, msg)
+** packs the message with a flag byte if it saves threshold percent at least, or adds the flag to the raw message
+*/
+static int
+lframe(lua_State *L) {
+	int threshold = (int)luaL_checkinteger(L, 1);
+	size_t sz=0;
+	const void * buffer = getbuffer(L, 2, &sz);
 	void * output = lua_touserdata(L, lua_upvalueindex(1));
 	int osz = lua_tointeger(L, lua_upvalueindex(2));
-	int r = sproto_unpack(buffer, sz, output, osz);
-	if (r < 0)
-		return luaL_error(L, "Invalid unpack stream");
+	int r = sproto_frame(buffer, (int)sz, output, osz, threshold);
 	if (r > osz) {
 		output = expand_buffer(L, osz, r);
-		r = sproto_unpack(buffer, sz, output, r);
-		if (r < 0)
-			return luaL_error(L, "Invalid unpack stream");
+		r = sproto_frame(buffer, (int)sz, output, r, threshold);
 	}
 	lua_pushlstring(L, (const char *)output, r);
 	return 1;
 }
 
+/*
+** msg = sproto.unframe(frame)
+** unpacks the frame made by sproto.frame, packed or raw
+*/
+static int
+lunframe(lua_State *L) {
+	size_t sz=0;
+	const uint8_t * buffer = (const uint8_t *)getbuffer(L, 1, &sz);
+	const struct sproto_limit * limit = (const struct sproto_limit *)lua_touserdata(L, lua_upvalueindex(3));
+	if (sz < 1)
+		return luaL_error(L, "Invalid frame");
+	switch (buffer[0]) {
+	case SPROTO_FRAME_PACKED:
+		return unpack_string(L, buffer + 1, (int)sz - 1);
+	case SPROTO_FRAME_RAW:
+		if (limit->unpacked > 0 && (int)sz - 1 > limit->unpacked)
+			return luaL_error(L, "unpack error: the size exceeds the limit (%d)", limit->unpacked);
+		lua_pushlstring(L, (const char *)buffer + 1, sz - 1);
+		return 1;
+	}
+	return luaL_error(L, "Invalid frame");
+}
+
+/*
+** msg, offset = sproto.unpackprefix(size, pack_msg)
+** unpacks the first size bytes (or the first message if size is nil) of the string packed by sproto.pack,
+** msg may be longer than size for the whole words, and offset is the packed bytes read
+*/
+static int
+lunpackprefix(lua_State *L) {
+	int size = (int)luaL_optinteger(L, 1, -1);
+	size_t sz=0;
+	const void * buffer = getbuffer(L, 2, &sz);
+	void * output = lua_touserdata(L, lua_upvalueindex(1));
+	int osz = lua_tointeger(L, lua_upvalueindex(2));
+	int used = 0;
+	int r;
+	for (;;) {
+		r = sproto_unpack_prefix(buffer, (int)sz, output, osz, size, &used);
+		if (r != -3)
+			break;
+		// a 0xff run may pass the size by 2048 bytes at most
+		r = sproto_unpacked_size(buffer, (int)sz);
+		if (size >= 0 && r > size + 2048)
+			r = size + 2048;
+		output = expand_buffer(L, osz, r > osz ? r : osz + 1);
+		osz = lua_tointeger(L, lua_upvalueindex(2));
+	}
+	if (r < 0)
+		return luaL_error(L, "Invalid unpack stream");
+	lua_pushlstring(L, (const char *)output, r);
+	lua_pushinteger(L, used);
+	return 2;
+}
+
 static void
 pushfunction_withbuffer(lua_State *L, const char * name, lua_CFunction func) {
 	lua_newuserdata(L, ENCODE_BUFFERSIZE);
@@ -775,8 +1360,317 @@ ldefault(lua_State *L) {
 	return 1;
 }
 
+/*
+	blob = sproto.blob(code)
+	marks a string encoded by sproto.encode, it's copied as it is for a struct field or element when encoding
+ */
+static int
+lblob(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TSTRING);
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	luaL_getmetatable(L, BLOB_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+#define VIEW_METATABLE "sproto.view"
+#define VIEWARRAY_METATABLE "sproto.viewarray"
+
+struct lview {
+	struct sproto_type * st;
+	struct sproto_view * view;
+};
+
+struct lview_array {
+	struct lview * v;
+	struct sproto_view_field f;
+};
+
+// the value on the top keeps alive as long as the userdata at index
+static void
+setref(lua_State *L, int index) {
+#if LUA_VERSION_NUM < 503
+	// the uservalue (environment) of userdata must be a table before lua 5.3
+	lua_createtable(L, 1, 0);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, 1);	// the table takes the place of the value
+#if LUA_VERSION_NUM < 502
+	lua_setfenv(L, index);
+#else
+	lua_setuservalue(L, index);
+#endif
+#else
+	lua_setuservalue(L, index);
+#endif
+}
+
+static void
+newview(lua_State *L, struct sproto_type *st, const void *data, int sz, int ref) {
+	int vsz = sproto_view_size(st);
+	struct lview * v = (struct lview *)lua_newuserdata(L, sizeof(struct lview) + vsz);
+	v->st = st;
+	v->view = sproto_view_init(v+1, vsz, st, data, sz);
+	if (v->view == NULL) {
+		luaL_error(L, "view error");
+	}
+	luaL_getmetatable(L, VIEW_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, ref);
+	setref(L, -2);
+}
+
+// push the field (index 0) or the element of array, ref keeps the message alive
+static int
+pushview(lua_State *L, struct lview *v, const struct sproto_view_field *f, int index, int ref) {
+	int r;
+	switch (f->type) {
+	case SPROTO_TINTEGER: {
+		long long value;
+		r = sproto_view_integer(v->view, f->tag, index, &value);
+		if (r == 0) {
+			if (f->extra) {
+				lua_Number vn = (lua_Number)value;
+				lua_pushnumber(L, vn / f->extra);
+			} else {
+				lua_pushinteger(L, (lua_Integer)value);
+			}
+		}
+		break;
+	}
+	case SPROTO_TBOOLEAN: {
+		int value;
+		r = sproto_view_boolean(v->view, f->tag, index, &value);
+		if (r == 0)
+			lua_pushboolean(L, value);
+		break;
+	}
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT: {
+		const void * str;
+		int sz;
+		r = sproto_view_string(v->view, f->tag, index, &str, &sz);
+		if (r == 0) {
+			if (f->type == SPROTO_TSTRING) {
+				lua_pushlstring(L, (const char *)str, sz);
+			} else {
+				newview(L, f->subtype, str, sz, ref);
+			}
+		}
+		break;
+	}
+	default:
+		r = SPROTO_CB_ERROR;
+		break;
+	}
+	if (r == SPROTO_CB_NIL) {
+		lua_pushnil(L);
+	} else if (r != 0) {
+		return luaL_error(L, "view error");
+	}
+	return 1;
+}
+
+/*
+	lightuserdata sproto_type
+	table sproto object (the owner of sproto_type)
+	string source / (lightuserdata , integer)
+	return view userdata
+ */
+static int
+lview(lua_State *L) {
+	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
+	const void * buffer;
+	size_t sz = 0;
+	if (st == NULL) {
+		return luaL_argerror(L, 1, "Need a sproto_type object");
+	}
+	buffer = getbuffer(L, 3, &sz);
+	// the view refers to the source, not a copy of it, and to the sproto object for the types.
+	// the sub views and arrays refer to their parent.
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, 2);
+	newview(L, st, buffer, (int)sz, lua_gettop(L));
+	return 1;
+}
+
+static int
+lview_index(lua_State *L) {
+	struct lview * v = (struct lview *)luaL_checkudata(L, 1, VIEW_METATABLE);
+	const char * name = luaL_checkstring(L, 2);
+	struct sproto_view_field f;
+	if (sproto_view_lookup(v->st, name, &f)) {
+		return luaL_error(L, "Invalid field name %s", name);
+	}
+	if (f.array) {
+		struct lview_array * a;
+		int n = sproto_view_count(v->view, f.tag);
+		if (n == SPROTO_CB_NIL) {
+			lua_pushnil(L);
+			return 1;
+		}
+		if (n < 0) {
+			return luaL_error(L, "view error");
+		}
+		a = (struct lview_array *)lua_newuserdata(L, sizeof(*a));
+		a->v = v;
+		a->f = f;
+		luaL_getmetatable(L, VIEWARRAY_METATABLE);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, 1);
+		setref(L, -2);
+		return 1;
+	}
+	return pushview(L, v, &f, 0, 1);
+}
+
+static int
+lviewarray_len(lua_State *L) {
+	struct lview_array * a = (struct lview_array *)luaL_checkudata(L, 1, VIEWARRAY_METATABLE);
+	lua_pushinteger(L, sproto_view_count(a->v->view, a->f.tag));
+	return 1;
+}
+
+static int
+lviewarray_index(lua_State *L) {
+	struct lview_array * a = (struct lview_array *)luaL_checkudata(L, 1, VIEWARRAY_METATABLE);
+	lua_Integer index = luaL_checkinteger(L, 2);
+	if (index < 1 || index > sproto_view_count(a->v->view, a->f.tag)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	return pushview(L, a->v, &a->f, (int)index, 1);
+}
+
+// owner is the index of the sproto object for the root projection, or 0 for a sub projection
+static struct lprojection *
+newprojection(lua_State *L, struct sproto_type *st, int index, int owner, int deep) {
+	struct lprojection * p;
+	const struct sproto_projection ** sub;
+	int * tag;
+	int n = 0;
+	int refs;
+	int nsub = 0;
+	if (deep >= ENCODE_DEEPLEVEL)
+		luaL_error(L, "The projection is too deep");
+	luaL_checkstack(L, 8, NULL);
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		++n;
+		lua_pop(L, 1);
+	}
+	p = (struct lprojection *)lua_newuserdata(L, sizeof(*p) + n * (sizeof(*sub) + sizeof(*tag)));
+	sub = (const struct sproto_projection **)(p + 1);
+	tag = (int *)(sub + n);
+	p->st = st;
+	p->p.n = 0;
+	p->p.tag = tag;
+	p->p.sub = NULL;
+	luaL_getmetatable(L, PROJECTION_METATABLE);
+	lua_setmetatable(L, -2);
+	// the sub projections, and the sproto object of the types at [0]
+	lua_newtable(L);
+	refs = lua_gettop(L);
+	if (owner) {
+		lua_pushvalue(L, owner);
+		lua_rawseti(L, refs, 0);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		// { "name", name = { sub fields } }
+		struct sproto_view_field f;
+		const struct sproto_projection * s = NULL;
+		const char * name;
+		int i;
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			name = lua_tostring(L, -2);
+		} else {
+			name = lua_tostring(L, -1);
+			if (name == NULL)
+				luaL_error(L, "Invalid field name in projection");
+		}
+		if (sproto_view_lookup(st, name, &f)) {
+			luaL_error(L, "Invalid field name %s", name);
+		}
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			if (!lua_istable(L, -1)) {
+				luaL_error(L, "Need a table to project .%s", name);
+			}
+			if (f.type != SPROTO_TSTRUCT) {
+				luaL_error(L, ".%s is not a struct", name);
+			}
+			s = &newprojection(L, f.subtype, lua_gettop(L), 0, deep + 1)->p;
+			lua_rawseti(L, refs, ++nsub);
+		}
+		// keep the tags ascending
+		for (i = p->p.n; i > 0 && tag[i-1] > f.tag; i--) {
+			tag[i] = tag[i-1];
+			sub[i] = sub[i-1];
+		}
+		if (i > 0 && tag[i-1] == f.tag) {
+			luaL_error(L, "Duplicate field %s in projection", name);
+		}
+		tag[i] = f.tag;
+		sub[i] = s;
+		++p->p.n;
+		lua_pop(L, 1);
+	}
+	if (nsub > 0) {
+		p->p.sub = sub;
+	}
+	setref(L, -2);
+	return p;
+}
+
+/*
+	lightuserdata sproto_type
+	table sproto object (the owner of sproto_type)
+	table fields : { "name", name = { sub fields }, ... }
+	return projection userdata, which sproto.decode accepts instead of the type
+ */
+static int
+lprojection(lua_State *L) {
+	struct sproto_type * st = (struct sproto_type *)lua_touserdata(L, 1);
+	if (st == NULL) {
+		return luaL_argerror(L, 1, "Need a sproto_type object");
+	}
+	luaL_checktype(L, 3, LUA_TTABLE);
+	newprojection(L, st, 3, 2, 0);
+	return 1;
+}
+
+static int
+getlimit(lua_State *L, const char *name) {
+	int v;
+	lua_getfield(L, 1, name);
+	v = (int)luaL_optinteger(L, -1, 0);
+	lua_pop(L, 1);
+	return v < 0 ? 0 : v;
+}
+
+/*
+** sproto.limit { unpacked = , elements = , depth = , string = , tables = }
+** sets the limits of decode and unpack for the untrusted input, nil or 0 means no limit.
+*/
+static int
+llimit(lua_State *L) {
+	struct sproto_limit * limit = (struct sproto_limit *)lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	limit->unpacked = getlimit(L, "unpacked");
+	limit->elements = getlimit(L, "elements");
+	limit->depth = getlimit(L, "depth");
+	limit->string = getlimit(L, "string");
+	limit->tables = getlimit(L, "tables");
+	return 0;
+}
+
 LUAMOD_API int
 luaopen_sproto_core(lua_State *L) {
+	struct sproto_limit * limit;
 #ifdef luaL_checkversion
 	luaL_checkversion(L);
 #endif
@@ -785,16 +1679,75 @@ luaopen_sproto_core(lua_State *L) {
 		{ "deleteproto", ldeleteproto },
 		{ "dumpproto", ldumpproto },
 		{ "querytype", lquerytype },
-		{ "decode", ldecode },
+		{ "verify", lverify },
+		{ "encodesize", lencodesize },
 		{ "protocol", lprotocol },
 		{ "loadproto", lloadproto },
 		{ "saveproto", lsaveproto },
 		{ "default", ldefault },
+		{ "blob", lblob },
+		{ "view", lview },
+		{ "projection", lprojection },
 		{ NULL, NULL },
 	};
+	luaL_newmetatable(L, BLOB_METATABLE);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, PROJECTION_METATABLE);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, VIEW_METATABLE);
+	lua_pushcfunction(L, lview_index);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+	luaL_newmetatable(L, VIEWARRAY_METATABLE);
+	lua_pushcfunction(L, lviewarray_index);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lviewarray_len);
+	lua_setfield(L, -2, "__len");
+	lua_pop(L, 1);
 	luaL_newlib(L,l);
-	pushfunction_withbuffer(L, "encode", lencode);
+	// encode has the third upvalue, a writer for the large message
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	*(struct sproto_writer **)lua_newuserdata(L, sizeof(struct sproto_writer *)) = NULL;
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, lwriter_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pushcclosure(L, lencode, 3);
+	lua_setfield(L, -2, "encode");
 	pushfunction_withbuffer(L, "pack", lpack);
-	pushfunction_withbuffer(L, "unpack", lunpack);
+	pushfunction_withbuffer(L, "pencode", lpencode);
+	pushfunction_withbuffer(L, "unpackprefix", lunpackprefix);
+	pushfunction_withbuffer(L, "frame", lframe);
+	// the limits are shared by decode, pdecode, fdecode, unpack, unframe and limit
+	limit = (struct sproto_limit *)lua_newuserdata(L, sizeof(*limit));
+	memset(limit, 0, sizeof(*limit));
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, ldecode, 1);
+	lua_setfield(L, -3, "decode");
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, llimit, 1);
+	lua_setfield(L, -3, "limit");
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, lunpack, 3);
+	lua_setfield(L, -3, "unpack");
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, lpdecode, 3);
+	lua_setfield(L, -3, "pdecode");
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, lfdecode, 3);
+	lua_setfield(L, -3, "fdecode");
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	lua_pushvalue(L, -3);
+	lua_pushcclosure(L, lunframe, 3);
+	lua_setfield(L, -3, "unframe");
+	lua_pop(L, 1);
 	return 1;
 }
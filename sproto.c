@@ -2,10 +2,38 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 #include "msvcint.h"
 
 #include "sproto.h"
 
+#ifndef SPROTO_NOSIMD
+#if defined(__AVX2__)
+#define SPROTO_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPROTO_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define SPROTO_SSSE3
+#include <tmmintrin.h>
+#endif
+#if !defined(SPROTO_AVX2) && (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+// the pack kernels not enabled at compile time are built for their own targets, and chosen by the cpu at load time
+#define SPROTO_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(SPROTO_SIMD_DISPATCH)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
 #define SPROTO_TARRAY 0x80
 #define CHUNK_SIZE 1000
 #define SIZEOF_LENGTH 4
@@ -23,12 +51,24 @@ struct field {
 	int extra;
 };
 
+// the nesting level of structs sproto_verify accepts, it recurses on the C stack
+#define VERIFY_DEEPLEVEL 256
+
+// the nesting level of structs sproto_decode_struct accepts, it recurses on the C stack too
+#define BIND_DEEPLEVEL 256
+
+// sparse tags are indexed by a dense array when the tag range is not larger than n times it, or by a hash
+#define LOOKUP_DENSE 4
+
 struct sproto_type {
 	const char * name;
 	int n;					// filed count
 	int base;				// ʼtag
 	int maxn;
 	struct field *f;		// filed array
+	int lookup_n;			// slots of lookup, 0 when the tags are contiguous
+	int lookup_mask;		// 0 for a dense array indexed by tag - f[0].tag, or the mask of a hash
+	struct field **lookup;	// tag -> field for sparse tags
 };
 
 struct protocol {
@@ -312,6 +352,53 @@ import_field(struct sproto *s, struct field *f, const uint8_t * stream) {
 	return result;
 }
 
+static inline unsigned
+lookup_hash(int tag) {
+	unsigned h = (unsigned)tag * 2654435761u;
+	return h ^ (h >> 16);
+}
+
+/*
+	ã
+		tagʱ tag -> field ʱضֲҡ
+		tagΧʱֱÿѰַhash
+	
+		rangef[0].tag  f[n-1].tag Ŀ
+*/
+static int
+build_lookup(struct sproto *s, struct sproto_type *t, int range) {
+	int i;
+	if (range <= t->n * LOOKUP_DENSE) {
+		int base = t->f[0].tag;
+		t->lookup_n = range;
+		t->lookup_mask = 0;
+		t->lookup = (struct field **)pool_alloc(&s->memory, sizeof(struct field *) * range);
+		if (t->lookup == NULL)
+			return -1;
+		memset(t->lookup, 0, sizeof(struct field *) * range);
+		for (i=0;i<t->n;i++) {
+			t->lookup[t->f[i].tag - base] = &t->f[i];
+		}
+	} else {
+		int sz = 2;
+		while (sz < t->n * 2)
+			sz *= 2;	// load factor no more than 1/2
+		t->lookup_n = sz;
+		t->lookup_mask = sz - 1;
+		t->lookup = (struct field **)pool_alloc(&s->memory, sizeof(struct field *) * sz);
+		if (t->lookup == NULL)
+			return -1;
+		memset(t->lookup, 0, sizeof(struct field *) * sz);
+		for (i=0;i<t->n;i++) {
+			unsigned h = lookup_hash(t->f[i].tag) & t->lookup_mask;
+			while (t->lookup[h])
+				h = (h + 1) & t->lookup_mask;
+			t->lookup[h] = &t->f[i];
+		}
+	}
+	return 0;
+}
+
 /*
 .type {
 	.field {
@@ -395,6 +482,8 @@ import_type(struct sproto *s, struct sproto_type *t, const uint8_t * stream) {
 	n = t->f[n-1].tag - t->base + 1; // tagֵnƥ䣬˵tag
 	if (n != t->n) {
 		t->base = -1;
+		if (build_lookup(s, t, n))
+			return NULL;
 	}
 	return result;
 }
@@ -564,13 +653,28 @@ sproto_release(struct sproto * s) {
 	pool_release(&s->memory);
 }
 
+size_t
+sproto_lookup_memory(const struct sproto *s) {
+	size_t sz = 0;
+	int i;
+	for (i=0;i<s->type_n;i++) {
+		sz += s->type[i].lookup_n * sizeof(struct field *);
+	}
+	return sz;
+}
+
 void
 sproto_dump(struct sproto *s) {
 	int i,j;
 	printf("=== %d types ===\n", s->type_n);
 	for (i=0;i<s->type_n;i++) {
 		struct sproto_type *t = &s->type[i];
-		printf("%s\n", t->name);
+		if (t->lookup) {
+			printf("%s (%s lookup %d bytes)\n", t->name, t->lookup_mask ? "hash" : "dense",
+				(int)(t->lookup_n * sizeof(struct field *)));
+		} else {
+			printf("%s\n", t->name);
+		}
 		for (j=0;j<t->n;j++) {
 			char array[2] = { 0, 0 };
 			const char * type_name = NULL;
@@ -616,6 +720,7 @@ sproto_dump(struct sproto *s) {
 			printf("\n");
 		}
 	}
+	printf("=== %d bytes of tag lookup ===\n", (int)sproto_lookup_memory(s));
 	printf("=== %d protocol ===\n", s->protocol_n);
 	for (i=0;i<s->protocol_n;i++) {
 		struct protocol *p = &s->proto[i];
@@ -721,6 +826,22 @@ findtag(const struct sproto_type *st, int tag) {
 			return NULL;
 		return &st->f[tag];
 	}
+	if (st->lookup_mask) {
+		unsigned h = lookup_hash(tag) & st->lookup_mask;
+		struct field *f;
+		while ((f = st->lookup[h])) {
+			if (f->tag == tag)
+				return f;
+			h = (h + 1) & st->lookup_mask;
+		}
+		return NULL;
+	}
+	if (st->lookup) {
+		tag -= st->f[0].tag;
+		if (tag < 0 || tag >= st->lookup_n)
+			return NULL;
+		return st->lookup[tag];
+	}
 	begin = 0;
 	end = st->n;
 	while (begin < end) {
@@ -739,6 +860,135 @@ findtag(const struct sproto_type *st, int tag) {
 	return NULL;
 }
 
+static inline uint64_t
+expand64(uint32_t v) {
+	uint64_t value = v;
+	if (value & 0x80000000) {
+		value |= (uint64_t)~0  << 32 ;
+	}
+	return value;
+}
+
+// integer arrays in bulk, x86 is little endian as the wire format
+
+// returns SIZEOF_INT64 if any integer doesn't fit in 32bit, or SIZEOF_INT32
+static int
+int64_width(const int64_t *v, int n) {
+	int i = 0;
+#if defined(SPROTO_AVX2)
+	__m256i eq = _mm256_set1_epi32(-1);
+	for (;i+4<=n;i+=4) {
+		// the high dword of each integer should be the sign of the low dword
+		__m256i x = _mm256_loadu_si256((const __m256i *)(v+i));
+		__m256i sign = _mm256_shuffle_epi32(_mm256_srai_epi32(x, 31), _MM_SHUFFLE(2,2,0,0));
+		eq = _mm256_and_si256(eq, _mm256_cmpeq_epi32(x, sign));
+	}
+	if (((unsigned)_mm256_movemask_epi8(eq) & 0xf0f0f0f0u) != 0xf0f0f0f0u)
+		return SIZEOF_INT64;
+#elif defined(SPROTO_SSE2)
+	__m128i eq = _mm_set1_epi32(-1);
+	for (;i+2<=n;i+=2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(v+i));
+		__m128i sign = _mm_shuffle_epi32(_mm_srai_epi32(x, 31), _MM_SHUFFLE(2,2,0,0));
+		eq = _mm_and_si128(eq, _mm_cmpeq_epi32(x, sign));
+	}
+	if ((_mm_movemask_epi8(eq) & 0xf0f0) != 0xf0f0)
+		return SIZEOF_INT64;
+#endif
+	for (;i<n;i++) {
+		if (v[i] != (int32_t)v[i])
+			return SIZEOF_INT64;
+	}
+	return SIZEOF_INT32;
+}
+
+// write the integers (fit in 32bit) as 32bit little endian
+static void
+int64_narrow(uint8_t *out, const int64_t *v, int n) {
+	int i = 0;
+#if defined(SPROTO_AVX2)
+	const __m256i low = _mm256_setr_epi32(0,2,4,6,1,3,5,7);
+	for (;i+4<=n;i+=4) {
+		__m256i x = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(v+i)), low);
+		_mm_storeu_si128((__m128i *)(out + i * SIZEOF_INT32), _mm256_castsi256_si128(x));
+	}
+#elif defined(SPROTO_SSE2)
+	for (;i+4<=n;i+=4) {
+		__m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(v+i)), _MM_SHUFFLE(3,1,2,0));
+		__m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(v+i+2)), _MM_SHUFFLE(3,1,2,0));
+		_mm_storeu_si128((__m128i *)(out + i * SIZEOF_INT32), _mm_unpacklo_epi64(a, b));
+	}
+#endif
+	for (;i<n;i++) {
+		uint32_t x = (uint32_t)v[i];
+		uint8_t *p = out + i * SIZEOF_INT32;
+		p[0] = x & 0xff;
+		p[1] = (x >> 8) & 0xff;
+		p[2] = (x >> 16) & 0xff;
+		p[3] = (x >> 24) & 0xff;
+	}
+}
+
+// write the integers as 64bit little endian
+static void
+int64_store(uint8_t *out, const int64_t *v, int n) {
+#if defined(SPROTO_SSE2)
+	memcpy(out, v, n * SIZEOF_INT64);
+#else
+	int i;
+	for (i=0;i<n;i++) {
+		uint64_t x = (uint64_t)v[i];
+		uint8_t *p = out + i * SIZEOF_INT64;
+		p[0] = x & 0xff;
+		p[1] = (x >> 8) & 0xff;
+		p[2] = (x >> 16) & 0xff;
+		p[3] = (x >> 24) & 0xff;
+		p[4] = (x >> 32) & 0xff;
+		p[5] = (x >> 40) & 0xff;
+		p[6] = (x >> 48) & 0xff;
+		p[7] = (x >> 56) & 0xff;
+	}
+#endif
+}
+
+// read 32bit little endian integers, and sign extend them
+static void
+int32_expand(int64_t *out, const uint8_t *in, int n) {
+	int i = 0;
+#if defined(SPROTO_AVX2)
+	for (;i+4<=n;i+=4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i * SIZEOF_INT32));
+		_mm256_storeu_si256((__m256i *)(out+i), _mm256_cvtepi32_epi64(x));
+	}
+#elif defined(SPROTO_SSE2)
+	for (;i+4<=n;i+=4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i * SIZEOF_INT32));
+		__m128i sign = _mm_srai_epi32(x, 31);
+		_mm_storeu_si128((__m128i *)(out+i), _mm_unpacklo_epi32(x, sign));
+		_mm_storeu_si128((__m128i *)(out+i+2), _mm_unpackhi_epi32(x, sign));
+	}
+#endif
+	for (;i<n;i++) {
+		out[i] = (int64_t)expand64(todword(in + i * SIZEOF_INT32));
+	}
+}
+
+// read 64bit little endian integers
+static void
+int64_load(int64_t *out, const uint8_t *in, int n) {
+#if defined(SPROTO_SSE2)
+	memcpy(out, in, n * SIZEOF_INT64);
+#else
+	int i;
+	for (i=0;i<n;i++) {
+		const uint8_t *p = in + i * SIZEOF_INT64;
+		uint64_t low = todword(p);
+		uint64_t hi = todword(p + SIZEOF_INT32);
+		out[i] = (int64_t)(low | hi << 32);
+	}
+#endif
+}
+
 // encode & decode
 // sproto_callback(void *ud, int tag, int type, struct sproto_type *, void *value, int length)
 //	  return size, -1 means error
@@ -819,19 +1069,102 @@ do_cb(sproto_callback cb, void *ud, const char *tagname, int type, int index, st
 		2Byte*n	:field value
 		nByte	:field data
 */
+#define BULK_BLOCK 256
+
+// an integer or boolean array the callback hands over in bulk (SPROTO_CB_BULK)
+struct bulk_array {
+	int bulk;	// the callback returns SPROTO_CB_BULK for the first element
+	int n;		// elements in block
+	int i;		// the next element in block
+	int last;	// block is the last one
+	union {
+		int64_t i[BULK_BLOCK];
+		uint8_t b[BULK_BLOCK];
+	} block;
+};
+
+static inline void
+bulk_init(struct bulk_array *r) {
+	r->bulk = 0;
+	r->n = 0;
+	r->i = 0;
+	r->last = 0;
+}
+
+// fetch the next block from args->index, returns the count of elements
+static int
+bulk_fill(sproto_callback cb, struct sproto_arg *args, struct bulk_array *r) {
+	int sz;
+	if (r->last)
+		return 0;
+	args->bulk = -1;
+	args->value = &r->block;
+	args->length = args->type == SPROTO_TINTEGER ? sizeof(r->block.i) : sizeof(r->block.b);
+	sz = cb(args);
+	args->bulk = 0;
+	if (sz < 0 || sz > BULK_BLOCK)
+		return SPROTO_CB_ERROR;
+	r->n = sz;
+	r->i = 0;
+	r->last = sz < BULK_BLOCK;
+	return sz;
+}
+
+/*
+	ã
+		ȡintegerbooleanһԪ(args->index)ֵͬcb
+		صڵһԪʱSPROTO_CB_BULK֮󰴿صһȡBULK_BLOCKԪ
+*/
+static int
+array_element(sproto_callback cb, struct sproto_arg *args, struct bulk_array *r, void *value, int length) {
+	int sz;
+	if (!r->bulk) {
+		args->value = value;
+		args->length = length;
+		sz = cb(args);
+		if (sz != SPROTO_CB_BULK)
+			return sz;
+		if (args->index != 1)
+			return SPROTO_CB_ERROR;
+		r->bulk = 1;
+	}
+	if (r->i == r->n) {
+		sz = bulk_fill(cb, args, r);
+		if (sz < 0)
+			return sz;
+		if (sz == 0)
+			return SPROTO_CB_NIL;
+	}
+	if (args->type == SPROTO_TINTEGER) {
+		int64_t v = r->block.i[r->i++];
+		if (v == (int32_t)v) {
+			uint32_t v32 = (uint32_t)v;
+			memcpy(value, &v32, sizeof(v32));
+			return SIZEOF_INT32;
+		}
+		memcpy(value, &v, sizeof(v));
+		return SIZEOF_INT64;
+	} else {
+		int v = r->block.b[r->i++] ? 1 : 0;
+		memcpy(value, &v, sizeof(v));
+		return sizeof(v);
+	}
+}
+
 static int
 encode_object(sproto_callback cb, struct sproto_arg *args, uint8_t *data, int size) {
 	int sz;
-	if (size < SIZEOF_LENGTH)
-		return -1;
+	// a nil object needs no space, so ask the callback before checking the size
 	args->value = data+SIZEOF_LENGTH;
-	args->length = size-SIZEOF_LENGTH;
+	args->length = size < SIZEOF_LENGTH ? 0 : size-SIZEOF_LENGTH;
 	sz = cb(args);
 	if (sz < 0) {
 		if (sz == SPROTO_CB_NIL)
 			return 0;
 		return -1;	// sz == SPROTO_CB_ERROR
 	}
+	if (size < SIZEOF_LENGTH)
+		return -1;
 	assert(sz <= size-SIZEOF_LENGTH);	// verify buffer overflow
 	return fill_size(data, sz);
 }
@@ -854,15 +1187,64 @@ uint32_to_uint64(int negative, uint8_t *buffer) {
 /*
 	飬Żÿһ泤ȣҲ˸ԣ32bitʱ64ĻҪ֮ǰ3264
 */
+/*
+	ã
+		صbulkʽṩʱ룺
+		һɨȷĿȣдһҪ64bitĿʱд32bitͳһչһ
+	أ
+		ݵĽβheaderΪintlenλ
+*/
+static uint8_t *
+encode_integer_bulk(sproto_callback cb, struct sproto_arg *args, uint8_t *header, int size) {
+	struct bulk_array r;
+	uint8_t * buffer = header + 1;
+	int intlen = SIZEOF_INT32;
+	int n = 0;
+	bulk_init(&r);
+	r.bulk = 1;
+	for (;;) {
+		int m = bulk_fill(cb, args, &r);
+		if (m < 0)
+			return NULL;
+		if (m == 0)
+			break;
+		if (intlen == SIZEOF_INT32 && int64_width(r.block.i, m) == SIZEOF_INT64) {
+			int i;
+			// rearrange the 32bit integers written before
+			if (size < n * SIZEOF_INT64)
+				return NULL;
+			for (i=n-1;i>=0;i--) {
+				uint8_t * p = header + 1 + i * SIZEOF_INT64;
+				memmove(p, header + 1 + i * SIZEOF_INT32, SIZEOF_INT32);
+				uint32_to_uint64(p[3] & 0x80, p);
+			}
+			intlen = SIZEOF_INT64;
+			buffer = header + 1 + n * SIZEOF_INT64;
+		}
+		if (size < n * intlen || (size - n * intlen) / intlen < m)
+			return NULL;
+		if (intlen == SIZEOF_INT32) {
+			int64_narrow(buffer, r.block.i, m);
+		} else {
+			int64_store(buffer, r.block.i, m);
+		}
+		buffer += m * intlen;
+		n += m;
+		args->index += m;
+	}
+	if (n == 0)
+		return header;
+	*header = (uint8_t)intlen;
+	return buffer;
+}
+
 static uint8_t *
 encode_integer_array(sproto_callback cb, struct sproto_arg *args, uint8_t *buffer, int size, int *noarray) {
 	uint8_t * header = buffer;
 	int intlen;
 	int index;
-	if (size < 1)
-		return NULL;
 	buffer++;
-	size--;
+	size--;	// size may be negative, check it before writing any element
 	intlen = SIZEOF_INT32;
 	index = 1;
 	*noarray = 0;
@@ -884,11 +1266,13 @@ encode_integer_array(sproto_callback cb, struct sproto_arg *args, uint8_t *buffe
 				*noarray = 1;
 				break;
 			}
+			if (sz == SPROTO_CB_BULK && index == 1)
+				return encode_integer_bulk(cb, args, header, size);
 			return NULL;	// sz == SPROTO_CB_ERROR
 		}
 		// notice: sizeof(uint64_t) is size_t (unsigned) , size may be negative. See issue #75
 		// so use MACRO SIZOF_INT64 instead
-		if (size < SIZEOF_INT64)
+		if (size < intlen)
 			return NULL;
 		if (sz == SIZEOF_INT32) {
 			uint32_t v = u.u32;
@@ -958,8 +1342,7 @@ static int
 encode_array(sproto_callback cb, struct sproto_arg *args, uint8_t *data, int size) {
 	uint8_t * buffer;
 	int sz;
-	if (size < SIZEOF_LENGTH)
-		return -1;
+	// size may be negative here, a missing array (SPROTO_CB_NOARRAY) needs no space
 	size -= SIZEOF_LENGTH;
 	buffer = data + SIZEOF_LENGTH;
 	switch (args->type) {
@@ -974,13 +1357,13 @@ encode_array(sproto_callback cb, struct sproto_arg *args, uint8_t *data, int siz
 		}
 		break;
 	}
-	case SPROTO_TBOOLEAN:
+	case SPROTO_TBOOLEAN: {
+		struct bulk_array bulk;
+		bulk_init(&bulk);
 		args->index = 1;
 		for (;;) {
 			int v = 0;
-			args->value = &v;
-			args->length = sizeof(v);
-			sz = cb(args);
+			sz = array_element(cb, args, &bulk, &v, sizeof(v));
 			if (sz < 0) {
 				if (sz == SPROTO_CB_NIL)		// nil object , end of array
 					break;
@@ -996,24 +1379,26 @@ encode_array(sproto_callback cb, struct sproto_arg *args, uint8_t *data, int siz
 			++args->index;
 		}
 		break;
+	}
 	default:
 		// ṹַ
 		args->index = 1;
 		for (;;) {
-			if (size < SIZEOF_LENGTH)
-				return -1;
 			size -= SIZEOF_LENGTH;	// ÿstringstructԪضᱣ泤
 			args->value = buffer+SIZEOF_LENGTH;
-			args->length = size;
+			args->length = size < 0 ? 0 : size;
 			sz = cb(args);
 			if (sz < 0) {
 				if (sz == SPROTO_CB_NIL) {
+					size += SIZEOF_LENGTH;
 					break;
 				}
 				if (sz == SPROTO_CB_NOARRAY)	// no array, don't encode it
 					return 0;
 				return -1;	// sz == SPROTO_CB_ERROR
 			}
+			if (size < sz)
+				return -1;
 			fill_size(buffer, sz);
 			buffer += SIZEOF_LENGTH+sz;
 			size -=sz;
@@ -1021,10 +1406,64 @@ encode_array(sproto_callback cb, struct sproto_arg *args, uint8_t *data, int siz
 		}
 		break;
 	}
+	if (size < 0)
+		return -1;
 	sz = buffer - (data + SIZEOF_LENGTH);
 	return fill_size(data, sz);
 }
 
+// encode an integer or boolean field, returns the size of data (*value is not 0 if it's in the record),
+// or SPROTO_CB_NIL, SPROTO_CB_NOARRAY, -1
+static inline int
+encode_scalar(sproto_callback cb, struct sproto_arg *args, uint8_t *data, int size, int *value) {
+	union {
+		uint64_t u64;
+		uint32_t u32;
+	} u;
+	int sz;
+	args->value = &u;
+	args->length = sizeof(u);
+	sz = cb(args);
+	if (sz < 0) {
+		if (sz == SPROTO_CB_NIL || sz == SPROTO_CB_NOARRAY)
+			return sz;
+		return -1;	// sz == SPROTO_CB_ERROR
+	}
+	if (sz == SIZEOF_INT32) {
+		// 2ֽڿԴŵ£Ͱvalueֱӷŵfield valueŵdata
+		if (u.u32 < 0x7fff) {
+			*value = (u.u32+1) * 2;
+			return 2; // sz can be any number > 0
+		}
+		return encode_integer(u.u32, data, size);
+	} else if (sz == SIZEOF_INT64) {
+		return encode_uint64(u.u64, data, size);
+	}
+	return -1;
+}
+
+// append the record of field to the header, returns -1 if the skip is too large
+static inline int
+encode_record(uint8_t *records, int *index, int *lasttag, const struct field *f, int value) {
+	uint8_t * record = records+SIZEOF_FIELD*(*index);	// recodrdΪ Ӧfield valueڴ
+	int tag = f->tag - *lasttag - 1;
+	if (tag > 0) {
+		// skip tag
+		tag = (tag - 1) * 2 + 1;	// tagмпȱһtag valueȱ
+		if (tag > 0xffff)
+			return -1;
+		record[0] = tag & 0xff;
+		record[1] = (tag >> 8) & 0xff;
+		++*index;
+		record += SIZEOF_FIELD;
+	}
+	++*index;
+	record[0] = value & 0xff;
+	record[1] = (value >> 8) & 0xff;
+	*lasttag = f->tag;
+	return 0;
+}
+
 /*
 	ã
 		һνű(table)ָ͸ʽ
@@ -1047,6 +1486,7 @@ sproto_encode(const struct sproto_type *st, void * buffer, int size, sproto_call
 	struct sproto_arg args;
 	uint8_t * header = (uint8_t *)buffer;
 	uint8_t * data;
+	uint8_t * records = header + SIZEOF_HEADER;
 	int header_sz = SIZEOF_HEADER + st->maxn * SIZEOF_FIELD;
 	int i;
 	int index;
@@ -1055,6 +1495,10 @@ sproto_encode(const struct sproto_type *st, void * buffer, int size, sproto_call
 	if (size < header_sz)
 		return -1;
 	args.ud = ud;
+	args.writer = NULL;
+	args.bulk = 0;
+	args.projection = NULL;
+	args.nest = 0;
 	data = header + header_sz;
 	size -= header_sz;
 	index = 0;
@@ -1062,7 +1506,6 @@ sproto_encode(const struct sproto_type *st, void * buffer, int size, sproto_call
 	for (i=0;i<st->n;i++) {
 		// Ŀ͵ÿfieldȥűӦֵ
 		struct field *f = &st->f[i];
-		int type = f->type;
 		int value = 0;
 		int sz = -1;
 		args.tagname = f->name;
@@ -1070,377 +1513,3479 @@ sproto_encode(const struct sproto_type *st, void * buffer, int size, sproto_call
 		args.subtype = f->st;
 		args.mainindex = f->key;
 		args.extra = f->extra;
-		if (type & SPROTO_TARRAY) {
-			args.type = type & ~SPROTO_TARRAY;
-			sz = encode_array(cb, &args, data, size);
-		} else {
-			args.type = type;
+		switch (f->type) {
+		case SPROTO_TINTEGER:
+		case SPROTO_TBOOLEAN:
+			args.type = f->type;
 			args.index = 0;
-			switch(type) {
-			case SPROTO_TINTEGER:
-			case SPROTO_TBOOLEAN: {
-				union {
-					uint64_t u64;
-					uint32_t u32;
-				} u;
-				args.value = &u;
-				args.length = sizeof(u);
-				sz = cb(&args);
-				if (sz < 0) {
-					if (sz == SPROTO_CB_NIL)
-						continue;
-					if (sz == SPROTO_CB_NOARRAY)	// no array, don't encode it
-						return 0;
-					return -1;	// sz == SPROTO_CB_ERROR
-				}
-				if (sz == SIZEOF_INT32) {
-					// 2ֽڿԴŵ£Ͱvalueֱӷŵfield valueŵdata
-					if (u.u32 < 0x7fff) {
-						value = (u.u32+1) * 2;
-						sz = 2; // sz can be any number > 0
-					} else {
-						sz = encode_integer(u.u32, data, size);
-					}
-				} else if (sz == SIZEOF_INT64) {
-					sz= encode_uint64(u.u64, data, size);
-				} else {
-					return -1;
-				}
-				break;
-			}
-			case SPROTO_TSTRUCT:
-			case SPROTO_TSTRING:
-				sz = encode_object(cb, &args, data, size);
-				break;
-			}
+			sz = encode_scalar(cb, &args, data, size, &value);
+			if (sz == SPROTO_CB_NIL)
+				continue;
+			if (sz == SPROTO_CB_NOARRAY)	// no array, don't encode it
+				return 0;
+			break;
+		case SPROTO_TSTRING:
+		case SPROTO_TSTRUCT:
+			args.type = f->type;
+			args.index = 0;
+			sz = encode_object(cb, &args, data, size);
+			break;
+		case SPROTO_TINTEGER | SPROTO_TARRAY:
+		case SPROTO_TBOOLEAN | SPROTO_TARRAY:
+		case SPROTO_TSTRING | SPROTO_TARRAY:
+		case SPROTO_TSTRUCT | SPROTO_TARRAY:
+			args.type = f->type & ~SPROTO_TARRAY;
+			sz = encode_array(cb, &args, data, size);
+			break;
 		}
 		if (sz < 0)
 			return -1;
 		if (sz > 0) {
-			uint8_t * record;
-			int tag;
 			// ɹ, szǱռõĿռ
 			if (value == 0) {
 				// field value ޷ţռdataοռ
 				data += sz;
 				size -= sz;
 			}
-			record = header+SIZEOF_HEADER+SIZEOF_FIELD*index;	// recodrdΪ Ӧfield valueڴ
-			tag = f->tag - lasttag - 1;
-			if (tag > 0) {
-				// skip tag
-				tag = (tag - 1) * 2 + 1;	// tagмпȱһtag valueȱ
-				if (tag > 0xffff)
-					return -1;
-				record[0] = tag & 0xff;
-				record[1] = (tag >> 8) & 0xff;
-				++index;
-				record += SIZEOF_FIELD;
-			}
-			++index;
-			record[0] = value & 0xff;
-			record[1] = (value >> 8) & 0xff;
-			lasttag = f->tag;
+			if (encode_record(records, &index, &lasttag, f, value))
+				return -1;
 		}
 	}
-	header[0] = index & 0xff;			
+	header[0] = index & 0xff;
 	header[1] = (index >> 8) & 0xff;
 
 	datasz = data - (header + header_sz);
 	data = header + header_sz;
 	if (index != st->maxn) {
-		// ûõst->maxnôfield(ΪfieldΪnil)ѹĿռ
+		// fieldԤĲͬ(ΪfieldΪnil)ƶݶ
 		memmove(header + SIZEOF_HEADER + index * SIZEOF_FIELD, data, datasz);
 	}
 	return SIZEOF_HEADER + index * SIZEOF_FIELD + datasz;
 }
 
+// encode size
+// The same walk as sproto_encode, but nothing is written. For SPROTO_TSTRING and SPROTO_TSTRUCT
+// the callback is invoked with args->value == NULL, and it should return the size the content
+// needs (for a struct, the result of sproto_encode_size on the subtype).
+
 static int
-decode_array_object(sproto_callback cb, struct sproto_arg *args, uint8_t * stream, int sz) {
-	uint32_t hsz;
-	int index = 1;
-	while (sz > 0) {
-		if (sz < SIZEOF_LENGTH)
-			return -1;
-		hsz = todword(stream);
-		stream += SIZEOF_LENGTH;
-		sz -= SIZEOF_LENGTH;
-		if (hsz > sz)
-			return -1;
-		args->index = index;
-		args->value = stream;
-		args->length = hsz;
-		if (cb(args))
-			return -1;
-		sz -= hsz;
-		stream += hsz;
-		++index;
+size_object(sproto_callback cb, struct sproto_arg *args) {
+	int sz;
+	args->value = NULL;
+	args->length = 0;
+	sz = cb(args);
+	if (sz < 0) {
+		if (sz == SPROTO_CB_NIL)
+			return 0;
+		return -1;	// sz == SPROTO_CB_ERROR
 	}
-	return 0;
+	return sz + SIZEOF_LENGTH;
 }
 
-static inline uint64_t
-expand64(uint32_t v) {
-	uint64_t value = v;
-	if (value & 0x80000000) {
-		value |= (uint64_t)~0  << 32 ;
+// the data size of an integer or boolean, it's not counted if *inplace is set (in the field value)
+static int
+size_scalar(sproto_callback cb, struct sproto_arg *args, int *inplace) {
+	union {
+		uint64_t u64;
+		uint32_t u32;
+	} u;
+	int sz;
+	args->value = &u;
+	args->length = sizeof(u);
+	sz = cb(args);
+	if (sz < 0) {
+		if (sz == SPROTO_CB_NIL || sz == SPROTO_CB_NOARRAY)
+			return sz;
+		return -1;	// sz == SPROTO_CB_ERROR
 	}
-	return value;
+	if (sz == SIZEOF_INT32) {
+		if (u.u32 < 0x7fff) {
+			*inplace = 1;
+			return SIZEOF_INT32;
+		}
+		return SIZEOF_LENGTH + SIZEOF_INT32;
+	}
+	if (sz == SIZEOF_INT64)
+		return SIZEOF_LENGTH + SIZEOF_INT64;
+	return -1;
 }
 
 static int
-decode_array(sproto_callback cb, struct sproto_arg *args, uint8_t * stream) {
-	uint32_t sz = todword(stream);
-	int type = args->type;
-	int i;
-	if (sz == 0) {
-		// It's empty array, call cb with index == -1 to create the empty array.
-		args->index = -1;
-		args->value = NULL;
-		args->length = 0;
-		cb(args);
-		return 0;
-	}	
-	stream += SIZEOF_LENGTH;
-	switch (type) {
+size_array(sproto_callback cb, struct sproto_arg *args) {
+	int sz;
+	int total = 0;
+	args->index = 1;
+	switch (args->type) {
 	case SPROTO_TINTEGER: {
-		int len = *stream;
-		++stream;
-		--sz;
-		if (len == SIZEOF_INT32) {
-			if (sz % SIZEOF_INT32 != 0)
-				return -1;
-			for (i=0;i<sz/SIZEOF_INT32;i++) {
-				uint64_t value = expand64(todword(stream + i*SIZEOF_INT32));
-				args->index = i+1;
-				args->value = &value;
-				args->length = sizeof(value);
-				cb(args);
+		struct bulk_array bulk;
+		int intlen = SIZEOF_INT32;
+		int n = 0;
+		bulk_init(&bulk);
+		for (;;) {
+			union {
+				uint64_t u64;
+				uint32_t u32;
+			} u;
+			sz = array_element(cb, args, &bulk, &u, sizeof(u));
+			if (sz <= 0) {
+				if (sz == SPROTO_CB_NIL)
+					break;
+				if (sz == SPROTO_CB_NOARRAY)
+					return 0;
+				return -1;	// sz == SPROTO_CB_ERROR
 			}
-		} else if (len == SIZEOF_INT64) {
-			if (sz % SIZEOF_INT64 != 0)
+			if (sz == SIZEOF_INT64) {
+				intlen = SIZEOF_INT64;
+			} else if (sz != SIZEOF_INT32) {
 				return -1;
-			for (i=0;i<sz/SIZEOF_INT64;i++) {
-				uint64_t low = todword(stream + i*SIZEOF_INT64);
-				uint64_t hi = todword(stream + i*SIZEOF_INT64 + SIZEOF_INT32);
-				uint64_t value = low | hi << 32;
-				args->index = i+1;
-				args->value = &value;
-				args->length = sizeof(value);
-				cb(args);
 			}
-		} else {
-			return -1;
+			++n;
+			++args->index;
 		}
+		if (n > 0)
+			total = 1 + n * intlen;	// 1 byte for the int length
 		break;
 	}
-	case SPROTO_TBOOLEAN:
-		for (i=0;i<sz;i++) {
-			uint64_t value = stream[i];
-			args->index = i+1;
-			args->value = &value;
-			args->length = sizeof(value);
-			cb(args);
+	case SPROTO_TBOOLEAN: {
+		struct bulk_array bulk;
+		bulk_init(&bulk);
+		for (;;) {
+			int v = 0;
+			sz = array_element(cb, args, &bulk, &v, sizeof(v));
+			if (sz < 0) {
+				if (sz == SPROTO_CB_NIL)
+					break;
+				if (sz == SPROTO_CB_NOARRAY)
+					return 0;
+				return -1;	// sz == SPROTO_CB_ERROR
+			}
+			++total;
+			++args->index;
 		}
 		break;
-	case SPROTO_TSTRING:
-	case SPROTO_TSTRUCT:
-		return decode_array_object(cb, args, stream, sz);
+	}
 	default:
-		return -1;
+		for (;;) {
+			args->value = NULL;
+			args->length = 0;
+			sz = cb(args);
+			if (sz < 0) {
+				if (sz == SPROTO_CB_NIL)
+					break;
+				if (sz == SPROTO_CB_NOARRAY)
+					return 0;
+				return -1;	// sz == SPROTO_CB_ERROR
+			}
+			total += SIZEOF_LENGTH + sz;
+			++args->index;
+		}
+		break;
 	}
-	return 0;
+	return total + SIZEOF_LENGTH;
 }
 
 /*
 	ã
-		һζݽн룬tabletableud
-
-	
-		st				:Ŀ
-		buffer/size		:Ķ
-		cb				:ʵûص
-		ud				:
+		ֻһݣsproto_encodeĻСдκ
 
 	أ
-		õڴ
+		СĻsproto_encodeһܳɹ-1 ʾ
+		headermaxnԤnil field2ֽ/ÿnil field
 */
 int
-sproto_decode(const struct sproto_type *st, const void * data, int size, sproto_callback cb, void *ud) {
+sproto_encode_size(const struct sproto_type *st, sproto_callback cb, void *ud) {
 	struct sproto_arg args;
-	int total = size;
-	uint8_t * stream;
-	uint8_t * datastream;
-	int fn;
 	int i;
-	int tag;
-	if (size < SIZEOF_HEADER)
-		return -1;
-	// debug print
-	// printf("sproto_decode[%p] (%s)\n", ud, st->name);
-	stream = (void *)data;
-	fn = toword(stream);
-	stream += SIZEOF_HEADER;
-	size -= SIZEOF_HEADER ;
-	if (size < fn * SIZEOF_FIELD)
-		return -1;
-	datastream = stream + fn * SIZEOF_FIELD;
-	size -= fn * SIZEOF_FIELD;
+	int lasttag = -1;
+	int datasz = 0;
 	args.ud = ud;
-
-	tag = -1;
-	for (i=0;i<fn;i++) {
-		uint8_t * currentdata;
-		struct field * f;
-		int value = toword(stream + i * SIZEOF_FIELD);
-		++ tag;
-		if (value & 1) {
-			tag += value/2;
-			continue;
-		}
-		value = value/2 - 1;
-		currentdata = datastream;
-		if (value < 0) {
-			uint32_t sz;
-			if (size < SIZEOF_LENGTH)
-				return -1;
-			sz = todword(datastream);
-			if (size < sz + SIZEOF_LENGTH)
-				return -1;
-			datastream += sz+SIZEOF_LENGTH;
-			size -= sz+SIZEOF_LENGTH;
-		}
-		f = findtag(st, tag);
-		if (f == NULL)
-			continue;
+	args.writer = NULL;
+	args.bulk = 0;
+	args.projection = NULL;
+	args.nest = 0;
+	for (i=0;i<st->n;i++) {
+		struct field *f = &st->f[i];
+		int type = f->type;
+		int inplace = 0;
+		int sz;
 		args.tagname = f->name;
 		args.tagid = f->tag;
-		args.type = f->type & ~SPROTO_TARRAY;
 		args.subtype = f->st;
-		args.index = 0;
 		args.mainindex = f->key;
 		args.extra = f->extra;
-		if (value < 0) {
-			if (f->type & SPROTO_TARRAY) {
-				if (decode_array(cb, &args, currentdata)) {
-					return -1;
-				}
-			} else {
-				switch (f->type) {
-				case SPROTO_TINTEGER: {
-					uint32_t sz = todword(currentdata);
-					if (sz == SIZEOF_INT32) {
-						uint64_t v = expand64(todword(currentdata + SIZEOF_LENGTH));
-						args.value = &v;
-						args.length = sizeof(v);
-						cb(&args);
-					} else if (sz != SIZEOF_INT64) {
-						return -1;
-					} else {
-						uint32_t low = todword(currentdata + SIZEOF_LENGTH);
-						uint32_t hi = todword(currentdata + SIZEOF_LENGTH + sizeof(uint32_t));
-						uint64_t v = (uint64_t)low | (uint64_t) hi << 32;
-						args.value = &v;
-						args.length = sizeof(v);
-						cb(&args);
-					}
-					break;
-				}
-				case SPROTO_TSTRING:
-				case SPROTO_TSTRUCT: {
-					uint32_t sz = todword(currentdata);
-					args.value = currentdata+SIZEOF_LENGTH;
-					args.length = sz;
-					if (cb(&args))
-						return -1;
-					break;
-				}
-				default:
-					return -1;
-				}
+		if (type & SPROTO_TARRAY) {
+			args.type = type & ~SPROTO_TARRAY;
+			sz = size_array(cb, &args);
+		} else {
+			args.type = type;
+			args.index = 0;
+			switch(type) {
+			case SPROTO_TINTEGER:
+			case SPROTO_TBOOLEAN:
+				sz = size_scalar(cb, &args, &inplace);
+				if (sz == SPROTO_CB_NIL)
+					continue;
+				if (sz == SPROTO_CB_NOARRAY)	// no array, don't encode it
+					return 0;
+				break;
+			case SPROTO_TSTRUCT:
+			case SPROTO_TSTRING:
+				sz = size_object(cb, &args);
+				break;
+			default:
+				return -1;
 			}
-		} else if (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN) {
+		}
+		if (sz < 0)
 			return -1;
+		if (sz > 0) {
+			if ((f->tag - lasttag - 2) * 2 + 1 > 0xffff)
+				return -1;	// skip tag overflow, the same as sproto_encode
+			if (!inplace)
+				datasz += sz;
+			lasttag = f->tag;
+		}
+	}
+	return SIZEOF_HEADER + st->maxn * SIZEOF_FIELD + datasz;
+}
+
+// writer : encode into a chain of chunks
+
+struct writer_chunk {
+	struct writer_chunk * next;
+	int size;
+	int used;
+	const uint8_t * ref;	// not NULL for the referenced data, size == used
+};
+
+struct sproto_writer {
+	struct writer_chunk * head;
+	struct writer_chunk * current;
+	int chunksize;
+	int total;
+	int threshold;	// reference the data instead of copying it when it's not less than threshold
+};
+
+// a position in the writer, used to rewind
+struct writer_pos {
+	struct writer_chunk * chunk;
+	int offset;
+	int total;
+};
+
+#define WRITER_DEFAULT_CHUNK 4096
+
+struct sproto_writer *
+sproto_writer_create(int chunksize) {
+	struct sproto_writer * w = (struct sproto_writer *)malloc(sizeof(*w));
+	if (w == NULL)
+		return NULL;
+	w->head = NULL;
+	w->current = NULL;
+	w->chunksize = chunksize > 0 ? chunksize : WRITER_DEFAULT_CHUNK;
+	w->total = 0;
+	w->threshold = 0;
+	return w;
+}
+
+void
+sproto_writer_reference(struct sproto_writer *w, int threshold) {
+	w->threshold = threshold > 0 ? threshold : 0;
+}
+
+void
+sproto_writer_release(struct sproto_writer *w) {
+	struct writer_chunk * c;
+	if (w == NULL)
+		return;
+	c = w->head;
+	while (c) {
+		struct writer_chunk * n = c->next;
+		free(c);
+		c = n;
+	}
+	free(w);
+}
+
+// the chunks from *next to last are spare, the references are freed (the chunks after last are spare already)
+static void
+writer_spare(struct writer_chunk ** next, struct writer_chunk * last) {
+	struct writer_chunk * c;
+	while ((c = *next) != NULL) {
+		int end = (c == last);
+		if (c->ref) {
+			*next = c->next;
+			free(c);
 		} else {
-			uint64_t v = value;
-			args.value = &v;
-			args.length = sizeof(v);
-			cb(&args);
+			c->used = 0;
+			next = &c->next;
 		}
+		if (end)
+			break;
 	}
-	return total - size;
 }
 
-// 0 pack
+// drop the output, but keep the chunks for the next message
+void
+sproto_writer_reset(struct sproto_writer *w) {
+	writer_spare(&w->head, w->current);
+	w->current = w->head;
+	w->total = 0;
+}
 
-static int
-pack_seg(const uint8_t *src, uint8_t * buffer, int sz, int n) {
-	uint8_t header = 0;
-	int notzero = 0;
-	int i;
-	uint8_t * obuffer = buffer;
-	++buffer;
-	--sz;
-	if (sz < 0)
-		obuffer = NULL;
+int
+sproto_writer_size(const struct sproto_writer *w) {
+	return w->total;
+}
 
-	for (i=0;i<8;i++) {
-		if (src[i] != 0) {
-			notzero++;
-			header |= 1<<i;
-			if (sz > 0) {
-				*buffer = src[i];
-				++buffer;
-				--sz;
+static inline uint8_t *
+chunk_ptr(struct writer_chunk *c, int offset) {
+	if (c->ref)
+		return (uint8_t *)c->ref + offset;
+	return (uint8_t *)(c+1) + offset;
+}
+
+int
+sproto_writer_iov(const struct sproto_writer *w, struct sproto_iovec *iov, int n) {
+	struct writer_chunk * c;
+	int count = 0;
+	for (c = w->head; c; c = c->next) {
+		if (c->used > 0) {
+			if (count < n) {
+				iov[count].base = chunk_ptr(c, 0);
+				iov[count].len = c->used;
 			}
+			++count;
 		}
+		if (c == w->current)
+			break;
 	}
-	if ((notzero == 7 || notzero == 6) && n > 0) {
-		notzero = 8;
+	return count;
+}
+
+int
+sproto_writer_copy(const struct sproto_writer *w, void *buffer, int size) {
+	struct writer_chunk * c;
+	uint8_t * ptr = (uint8_t *)buffer;
+	if (size < w->total)
+		return -1;
+	for (c = w->head; c; c = c->next) {
+		memcpy(ptr, chunk_ptr(c, 0), c->used);
+		ptr += c->used;
+		if (c == w->current)
+			break;
 	}
-	if (notzero == 8) {
-		if (n > 0) {
-			return 8;
+	return w->total;
+}
+
+// switch to a chunk with at least sz free bytes, reuse the spare chunks after current
+static struct writer_chunk *
+writer_nextchunk(struct sproto_writer *w, int sz) {
+	struct writer_chunk * c = w->current ? w->current->next : w->head;
+	while (c && c->size < sz) {
+		// the spare chunk is too small, drop it
+		struct writer_chunk * n = c->next;
+		free(c);
+		c = n;
+		if (w->current) {
+			w->current->next = c;
 		} else {
-			return 10;
+			w->head = c;
 		}
 	}
-	if (obuffer) {
-		*obuffer = header;
+	if (c == NULL) {
+		int csz = sz > w->chunksize ? sz : w->chunksize;
+		struct writer_chunk * n = (struct writer_chunk *)malloc(sizeof(*n) + csz);
+		if (n == NULL)
+			return NULL;
+		n->size = csz;
+		n->ref = NULL;
+		n->next = c;
+		if (w->current) {
+			w->current->next = n;
+		} else {
+			w->head = n;
+		}
+		c = n;
 	}
-	return notzero + 1;
+	c->used = 0;
+	w->current = c;
+	return c;
 }
 
-static inline void
-write_ff(const uint8_t * src, uint8_t * des, int n) {
-	int i;
-	int align8_n = (n+7)&(~7);
+// sz contiguous bytes
+static uint8_t *
+writer_reserve(struct sproto_writer *w, int sz) {
+	struct writer_chunk * c = w->current;
+	uint8_t * ptr;
+	if (c == NULL || c->size - c->used < sz) {
+		c = writer_nextchunk(w, sz);
+		if (c == NULL)
+			return NULL;
+	}
+	ptr = chunk_ptr(c, c->used);
+	c->used += sz;
+	w->total += sz;
+	return ptr;
+}
 
-	des[0] = 0xff;
-	des[1] = align8_n/8 - 1;
-	memcpy(des+2, src, n);
-	for(i=0; i< align8_n-n; i++){
-		des[n+2+i] = 0;
+// free space in the current chunk, the callback can write into it directly
+static uint8_t *
+writer_space(struct sproto_writer *w, int *sz) {
+	struct writer_chunk * c = w->current;
+	if (c == NULL) {
+		*sz = 0;
+		return NULL;
 	}
+	*sz = c->size - c->used;
+	return chunk_ptr(c, c->used);
+}
+
+// append a chunk references the data after current
+static int
+writer_ref(struct sproto_writer *w, const void *data, int sz) {
+	struct writer_chunk * c = (struct writer_chunk *)malloc(sizeof(*c));
+	if (c == NULL)
+		return -1;
+	c->size = sz;
+	c->used = sz;
+	c->ref = (const uint8_t *)data;
+	if (w->current) {
+		c->next = w->current->next;
+		w->current->next = c;
+	} else {
+		c->next = w->head;
+		w->head = c;
+	}
+	w->current = c;
+	w->total += sz;
+	return sz;
 }
 
-/*
-** pack the message with the 0 packing algorithm.
-** srcv ԭ, srcsz:ԭݴСbufferv:Ŀ껺棬 bufsz:С
-*/
 int
-sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
-	uint8_t tmp[8];
-	int i;
-	const uint8_t * ff_srcstart = NULL;
-	uint8_t * ff_desstart = NULL;
-	int ff_n = 0;
-	int size = 0;
-	const uint8_t * src = (const uint8_t *)srcv;
-	uint8_t * buffer = (uint8_t *)bufferv;
-	for (i=0;i<srcsz;i+=8) {
-		int n;
-		int padding = i+8 - srcsz;
+sproto_writer_write(struct sproto_writer *w, const void *data, int sz) {
+	const uint8_t * src = (const uint8_t *)data;
+	int n = sz;
+	if (w->threshold > 0 && sz >= w->threshold)
+		return writer_ref(w, data, sz);
+	while (n > 0) {
+		struct writer_chunk * c = w->current;
+		int space = c ? c->size - c->used : 0;
+		if (space == 0) {
+			c = writer_nextchunk(w, 1);
+			if (c == NULL)
+				return -1;
+			space = c->size;
+		}
+		if (space > n)
+			space = n;
+		memcpy(chunk_ptr(c, c->used), src, space);
+		c->used += space;
+		w->total += space;
+		src += space;
+		n -= space;
+	}
+	return sz;
+}
+
+static void
+writer_tell(struct sproto_writer *w, struct writer_pos *pos) {
+	pos->chunk = w->current;
+	pos->offset = w->current ? w->current->used : 0;
+	pos->total = w->total;
+}
+
+static void
+writer_rewind(struct sproto_writer *w, const struct writer_pos *pos) {
+	if (pos->chunk == NULL) {
+		sproto_writer_reset(w);
+		return;
+	}
+	if (pos->chunk != w->current) {
+		writer_spare(&pos->chunk->next, w->current);
+	}
+	pos->chunk->used = pos->offset;
+	w->current = pos->chunk;
+	w->total = pos->total;
+}
+
+// read n bytes from pos, they may cross chunks
+static void
+writer_read(const struct writer_pos *pos, uint8_t *buffer, int n) {
+	struct writer_chunk * c = pos->chunk;
+	int offset = pos->offset;
+	while (n > 0) {
+		int sz;
+		if (c == NULL)
+			return;
+		sz = c->used - offset;
+		if (sz > n)
+			sz = n;
+		memcpy(buffer, chunk_ptr(c, offset), sz);
+		buffer += sz;
+		n -= sz;
+		c = c->next;
+		offset = 0;
+	}
+}
+
+static int
+writer_uint32(struct sproto_writer *w, uint32_t v) {
+	uint8_t * p = writer_reserve(w, SIZEOF_INT32);
+	if (p == NULL)
+		return -1;
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+	return SIZEOF_INT32;
+}
+
+static int
+writer_uint64(struct sproto_writer *w, uint64_t v) {
+	if (writer_uint32(w, (uint32_t)v) < 0 || writer_uint32(w, (uint32_t)(v >> 32)) < 0)
+		return -1;
+	return SIZEOF_INT64;
+}
+
+/*
+	string or struct, the callback writes the content into args->value (the free space of
+	the current chunk), or appends it by sproto_writer_write / sproto_encode_writer.
+*/
+static int
+writer_object(struct sproto_writer *w, sproto_callback cb, struct sproto_arg *args) {
+	struct writer_pos start, pos;
+	uint8_t * header;
+	int space;
+	int sz;
+	writer_tell(w, &start);
+	header = writer_reserve(w, SIZEOF_LENGTH);
+	if (header == NULL)
+		return -1;
+	writer_tell(w, &pos);
+	args->value = writer_space(w, &space);
+	args->length = space;
+	if (w->threshold > 0 && space >= w->threshold) {
+		// a large one should be appended by sproto_writer_write, so it can be referenced
+		args->length = w->threshold - 1;
+	}
+	sz = cb(args);
+	if (sz < 0) {
+		if (sz == SPROTO_CB_ERROR)
+			return -1;
+		// nil object or no array, nothing written, give back the length
+		writer_rewind(w, &start);
+		return sz == SPROTO_CB_NIL ? 0 : sz;
+	}
+	if (w->total == pos.total) {
+		// written into args->value
+		if (sz > space)
+			return -1;
+		w->current->used += sz;
+		w->total += sz;
+	} else if (w->total - pos.total != sz) {
+		return -1;
+	}
+	fill_size(header, sz);
+	return SIZEOF_LENGTH + sz;
+}
+
+static int
+writer_integer_array(struct sproto_writer *w, sproto_callback cb, struct sproto_arg *args, int *noarray) {
+	struct writer_pos start;
+	struct bulk_array bulk;
+	uint8_t * intlen_ptr = NULL;
+	int intlen = SIZEOF_INT32;
+	int n = 0;
+	*noarray = 0;
+	bulk_init(&bulk);
+	args->index = 1;
+	for (;;) {
+		int sz;
+		union {
+			uint64_t u64;
+			uint32_t u32;
+		} u;
+		sz = array_element(cb, args, &bulk, &u, sizeof(u));
+		if (sz <= 0) {
+			if (sz == SPROTO_CB_NIL) // nil object, end of array
+				break;
+			if (sz == SPROTO_CB_NOARRAY) {	// no array, don't encode it
+				*noarray = 1;
+				return 0;
+			}
+			return -1;	// sz == SPROTO_CB_ERROR
+		}
+		if (intlen_ptr == NULL) {
+			intlen_ptr = writer_reserve(w, 1);
+			if (intlen_ptr == NULL)
+				return -1;
+			writer_tell(w, &start);
+		}
+		if (sz == SIZEOF_INT32) {
+			uint32_t v = u.u32;
+			if (intlen == SIZEOF_INT32) {
+				if (writer_uint32(w, v) < 0)
+					return -1;
+			} else {
+				if (writer_uint64(w, (uint64_t)(int64_t)(int32_t)v) < 0)
+					return -1;
+			}
+		} else {
+			if (sz != SIZEOF_INT64)
+				return -1;
+			if (intlen == SIZEOF_INT32) {
+				// rearrange : read back the 32bit values, and write them again as 64bit
+				int i;
+				uint8_t * tmp = NULL;
+				if (n > 0) {
+					tmp = (uint8_t *)malloc(n * SIZEOF_INT32);
+					if (tmp == NULL)
+						return -1;
+					writer_read(&start, tmp, n * SIZEOF_INT32);
+				}
+				writer_rewind(w, &start);
+				for (i=0;i<n;i++) {
+					uint64_t v = expand64(todword(tmp + i * SIZEOF_INT32));
+					if (writer_uint64(w, v) < 0) {
+						free(tmp);
+						return -1;
+					}
+				}
+				free(tmp);
+				intlen = SIZEOF_INT64;
+			}
+			if (writer_uint64(w, u.u64) < 0)
+				return -1;
+		}
+		++n;
+		++args->index;
+	}
+	if (intlen_ptr == NULL)
+		return 0;
+	*intlen_ptr = (uint8_t)intlen;
+	return 1 + n * intlen;
+}
+
+static int
+writer_array(struct sproto_writer *w, sproto_callback cb, struct sproto_arg *args) {
+	struct writer_pos start;
+	uint8_t * header;
+	int total = 0;
+	int sz;
+	writer_tell(w, &start);
+	header = writer_reserve(w, SIZEOF_LENGTH);
+	if (header == NULL)
+		return -1;
+	switch (args->type) {
+	case SPROTO_TINTEGER: {
+		int noarray;
+		total = writer_integer_array(w, cb, args, &noarray);
+		if (total < 0)
+			return -1;
+		if (noarray)
+			goto noarray;
+		break;
+	}
+	case SPROTO_TBOOLEAN: {
+		struct bulk_array bulk;
+		bulk_init(&bulk);
+		args->index = 1;
+		for (;;) {
+			int v = 0;
+			uint8_t * p;
+			sz = array_element(cb, args, &bulk, &v, sizeof(v));
+			if (sz < 0) {
+				if (sz == SPROTO_CB_NIL)		// nil object , end of array
+					break;
+				if (sz == SPROTO_CB_NOARRAY)	// no array, don't encode it
+					goto noarray;
+				return -1;	// sz == SPROTO_CB_ERROR
+			}
+			p = writer_reserve(w, 1);
+			if (p == NULL)
+				return -1;
+			*p = v ? 1 : 0;
+			++total;
+			++args->index;
+		}
+		break;
+	}
+	default:
+		args->index = 1;
+		for (;;) {
+			sz = writer_object(w, cb, args);
+			if (sz < 0) {
+				if (sz == SPROTO_CB_NOARRAY)
+					goto noarray;
+				return -1;
+			}
+			if (sz == 0) // nil object, end of array
+				break;
+			total += sz;
+			++args->index;
+		}
+		break;
+	}
+	fill_size(header, total);
+	return SIZEOF_LENGTH + total;
+noarray:
+	// nothing but the length is written, give it back
+	writer_rewind(w, &start);
+	return 0;
+}
+
+/*
+	ã
+		sproto_encodeͬ뵽writerchunkУchunkʱµchunk룬ʧ
+		ص args->writer ΪNULLṹ sproto_encode_writer ͬһwriter
+
+	أ
+		α׷ӵֽ-1 ʾ
+*/
+int
+sproto_encode_writer(const struct sproto_type *st, struct sproto_writer *w, sproto_callback cb, void *ud) {
+	struct sproto_arg args;
+	struct writer_pos start;
+	struct writer_chunk * hchunk;
+	uint8_t * header;
+	int header_sz = SIZEOF_HEADER + st->maxn * SIZEOF_FIELD;
+	int hoffset;
+	int i;
+	int index;
+	int lasttag;
+	writer_tell(w, &start);
+	header = writer_reserve(w, header_sz);
+	if (header == NULL)
+		return -1;
+	hchunk = w->current;
+	hoffset = hchunk->used - header_sz;
+	args.ud = ud;
+	args.writer = w;
+	args.bulk = 0;
+	args.projection = NULL;
+	args.nest = 0;
+	index = 0;
+	lasttag = -1;
+	for (i=0;i<st->n;i++) {
+		struct field *f = &st->f[i];
+		int type = f->type;
+		int value = 0;
+		int sz = -1;
+		args.tagname = f->name;
+		args.tagid = f->tag;
+		args.subtype = f->st;
+		args.mainindex = f->key;
+		args.extra = f->extra;
+		if (type & SPROTO_TARRAY) {
+			args.type = type & ~SPROTO_TARRAY;
+			sz = writer_array(w, cb, &args);
+		} else {
+			args.type = type;
+			args.index = 0;
+			switch(type) {
+			case SPROTO_TINTEGER:
+			case SPROTO_TBOOLEAN: {
+				union {
+					uint64_t u64;
+					uint32_t u32;
+				} u;
+				args.value = &u;
+				args.length = sizeof(u);
+				sz = cb(&args);
+				if (sz < 0) {
+					if (sz == SPROTO_CB_NIL)
+						continue;
+					if (sz == SPROTO_CB_NOARRAY) {	// no array, don't encode it
+						writer_rewind(w, &start);
+						return 0;
+					}
+					return -1;	// sz == SPROTO_CB_ERROR
+				}
+				if (sz == SIZEOF_INT32) {
+					if (u.u32 < 0x7fff) {
+						value = (u.u32+1) * 2;
+						sz = 2; // sz can be any number > 0
+					} else {
+						uint8_t * p = writer_reserve(w, SIZEOF_LENGTH);
+						if (p == NULL)
+							return -1;
+						fill_size(p, SIZEOF_INT32);
+						sz = writer_uint32(w, u.u32);
+					}
+				} else if (sz == SIZEOF_INT64) {
+					uint8_t * p = writer_reserve(w, SIZEOF_LENGTH);
+					if (p == NULL)
+						return -1;
+					fill_size(p, SIZEOF_INT64);
+					sz = writer_uint64(w, u.u64);
+				} else {
+					return -1;
+				}
+				break;
+			}
+			case SPROTO_TSTRUCT:
+			case SPROTO_TSTRING:
+				sz = writer_object(w, cb, &args);
+				break;
+			}
+		}
+		if (sz < 0)
+			return -1;
+		if (sz > 0) {
+			uint8_t * record;
+			int tag;
+			record = header+SIZEOF_HEADER+SIZEOF_FIELD*index;
+			tag = f->tag - lasttag - 1;
+			if (tag > 0) {
+				// skip tag
+				tag = (tag - 1) * 2 + 1;
+				if (tag > 0xffff)
+					return -1;
+				record[0] = tag & 0xff;
+				record[1] = (tag >> 8) & 0xff;
+				++index;
+				record += SIZEOF_FIELD;
+			}
+			++index;
+			record[0] = value & 0xff;
+			record[1] = (value >> 8) & 0xff;
+			lasttag = f->tag;
+		}
+	}
+	header[0] = index & 0xff;
+	header[1] = (index >> 8) & 0xff;
+	if (index != st->maxn) {
+		// squeeze the unused header slots, only the data in the same chunk moves.
+		// The following chunks and the length prefixes of the outer objects are not touched.
+		int gap = (st->maxn - index) * SIZEOF_FIELD;
+		int tail = hoffset + header_sz;
+		memmove(chunk_ptr(hchunk, tail - gap), chunk_ptr(hchunk, tail), hchunk->used - tail);
+		hchunk->used -= gap;
+		w->total -= gap;
+	}
+	return w->total - start.total;
+}
+
+// trusted : the message is verified by sproto_verify, skip the bounds checks
+static inline int
+decode_array_object(sproto_callback cb, struct sproto_arg *args, uint8_t * stream, int sz, int trusted) {
+	uint32_t hsz;
+	int index = 1;
+	while (sz > 0) {
+		if (!trusted && sz < SIZEOF_LENGTH)
+			return -1;
+		hsz = todword(stream);
+		stream += SIZEOF_LENGTH;
+		sz -= SIZEOF_LENGTH;
+		if (!trusted && hsz > sz)
+			return -1;
+		args->index = index;
+		args->value = stream;
+		args->length = hsz;
+		if (cb(args))
+			return -1;
+		sz -= hsz;
+		stream += hsz;
+		++index;
+	}
+	return 0;
+}
+
+// deliver the integer array in blocks after the callback returns SPROTO_CB_BULK for the first element
+static int
+decode_integer_bulk(sproto_callback cb, struct sproto_arg *args, uint8_t * stream, int n, int len) {
+	int64_t block[BULK_BLOCK];
+	int i;
+	args->bulk = n;
+	for (i=0;i<n;i+=BULK_BLOCK) {
+		int m = n - i < BULK_BLOCK ? n - i : BULK_BLOCK;
+		if (len == SIZEOF_INT32) {
+			int32_expand(block, stream + i * len, m);
+		} else {
+			int64_load(block, stream + i * len, m);
+		}
+		args->index = i+1;
+		args->value = block;
+		args->length = m * sizeof(int64_t);
+		if (cb(args)) {
+			args->bulk = 0;
+			return -1;
+		}
+	}
+	args->bulk = 0;
+	return 0;
+}
+
+static inline int
+decode_array(sproto_callback cb, struct sproto_arg *args, uint8_t * stream, int trusted) {
+	uint32_t sz = todword(stream);
+	int type = args->type;
+	int i;
+	if (sz == 0) {
+		// It's empty array, call cb with index == -1 to create the empty array.
+		args->index = -1;
+		args->value = NULL;
+		args->length = 0;
+		cb(args);
+		return 0;
+	}	
+	stream += SIZEOF_LENGTH;
+	switch (type) {
+	case SPROTO_TINTEGER: {
+		int len = *stream;
+		++stream;
+		--sz;
+		if (len == SIZEOF_INT32) {
+			if (!trusted && sz % SIZEOF_INT32 != 0)
+				return -1;
+			for (i=0;i<sz/SIZEOF_INT32;i++) {
+				uint64_t value = expand64(todword(stream + i*SIZEOF_INT32));
+				args->index = i+1;
+				args->value = &value;
+				args->length = sizeof(value);
+				if (cb(args) == SPROTO_CB_BULK && i == 0)
+					return decode_integer_bulk(cb, args, stream, sz/SIZEOF_INT32, SIZEOF_INT32);
+			}
+		} else if (trusted || len == SIZEOF_INT64) {
+			if (!trusted && sz % SIZEOF_INT64 != 0)
+				return -1;
+			for (i=0;i<sz/SIZEOF_INT64;i++) {
+				uint64_t low = todword(stream + i*SIZEOF_INT64);
+				uint64_t hi = todword(stream + i*SIZEOF_INT64 + SIZEOF_INT32);
+				uint64_t value = low | hi << 32;
+				args->index = i+1;
+				args->value = &value;
+				args->length = sizeof(value);
+				if (cb(args) == SPROTO_CB_BULK && i == 0)
+					return decode_integer_bulk(cb, args, stream, sz/SIZEOF_INT64, SIZEOF_INT64);
+			}
+		} else {
+			return -1;
+		}
+		break;
+	}
+	case SPROTO_TBOOLEAN:
+		for (i=0;i<sz;i++) {
+			uint64_t value = stream[i];
+			args->index = i+1;
+			args->value = &value;
+			args->length = sizeof(value);
+			if (cb(args) == SPROTO_CB_BULK && i == 0) {
+				// the whole array in one span
+				int r;
+				args->bulk = sz;
+				args->value = stream;
+				args->length = sz;
+				r = cb(args);
+				args->bulk = 0;
+				return r ? -1 : 0;
+			}
+		}
+		break;
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT:
+		return decode_array_object(cb, args, stream, sz, trusted);
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	ã
+		һζݽн룬tabletableud
+
+	
+		st				:Ŀ
+		buffer/size		:Ķ
+		cb				:ʵûص
+		ud				:
+
+	أ
+		õڴ
+*/
+static inline int
+decode_message(const struct sproto_type *st, const void * data, int size, const struct sproto_projection *proj, sproto_callback cb, void *ud, int trusted) {
+	struct sproto_arg args;
+	int total = size;
+	uint8_t * stream;
+	uint8_t * datastream;
+	int fn;
+	int i;
+	int tag;
+	int selected = 0;	// the next tag of projection
+	if (!trusted && size < SIZEOF_HEADER)
+		return -1;
+	// debug print
+	// printf("sproto_decode[%p] (%s)\n", ud, st->name);
+	stream = (void *)data;
+	fn = toword(stream);
+	stream += SIZEOF_HEADER;
+	size -= SIZEOF_HEADER ;
+	if (!trusted && size < fn * SIZEOF_FIELD)
+		return -1;
+	datastream = stream + fn * SIZEOF_FIELD;
+	size -= fn * SIZEOF_FIELD;
+	args.ud = ud;
+	args.writer = NULL;
+	args.bulk = 0;
+	args.projection = NULL;
+	args.nest = 0;
+
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		uint8_t * currentdata;
+		struct field * f;
+		int value = toword(stream + i * SIZEOF_FIELD);
+		++ tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		if (proj) {
+			while (selected < proj->n && proj->tag[selected] < tag)
+				++selected;
+			if (selected == proj->n)	// all the selected tags are passed
+				break;
+		}
+		value = value/2 - 1;
+		currentdata = datastream;
+		if (value < 0) {
+			uint32_t sz;
+			if (!trusted && size < SIZEOF_LENGTH)
+				return -1;
+			sz = todword(datastream);
+			if (!trusted && sz > (uint32_t)(size - SIZEOF_LENGTH))
+				return -1;
+			datastream += sz+SIZEOF_LENGTH;
+			size -= sz+SIZEOF_LENGTH;
+		}
+		if (proj) {
+			if (proj->tag[selected] != tag)
+				continue;
+			args.projection = proj->sub ? proj->sub[selected] : NULL;
+		}
+		f = findtag(st, tag);
+		if (f == NULL)
+			continue;
+		args.tagname = f->name;
+		args.tagid = f->tag;
+		args.type = f->type & ~SPROTO_TARRAY;
+		args.subtype = f->st;
+		args.index = 0;
+		args.mainindex = f->key;
+		args.extra = f->extra;
+		if (value < 0) {
+			switch (f->type) {
+			case SPROTO_TINTEGER | SPROTO_TARRAY:
+			case SPROTO_TBOOLEAN | SPROTO_TARRAY:
+			case SPROTO_TSTRING | SPROTO_TARRAY:
+			case SPROTO_TSTRUCT | SPROTO_TARRAY:
+				if (decode_array(cb, &args, currentdata, trusted)) {
+					return -1;
+				}
+				break;
+			case SPROTO_TINTEGER: {
+				uint32_t sz = todword(currentdata);
+				if (sz == SIZEOF_INT32) {
+					uint64_t v = expand64(todword(currentdata + SIZEOF_LENGTH));
+					args.value = &v;
+					args.length = sizeof(v);
+					cb(&args);
+				} else if (!trusted && sz != SIZEOF_INT64) {
+					return -1;
+				} else {
+					uint32_t low = todword(currentdata + SIZEOF_LENGTH);
+					uint32_t hi = todword(currentdata + SIZEOF_LENGTH + sizeof(uint32_t));
+					uint64_t v = (uint64_t)low | (uint64_t) hi << 32;
+					args.value = &v;
+					args.length = sizeof(v);
+					cb(&args);
+				}
+				break;
+			}
+			case SPROTO_TSTRING:
+			case SPROTO_TSTRUCT: {
+				uint32_t sz = todword(currentdata);
+				args.value = currentdata+SIZEOF_LENGTH;
+				args.length = sz;
+				if (cb(&args))
+					return -1;
+				break;
+			}
+			default:
+				return -1;
+			}
+		} else if (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN) {
+			return -1;
+		} else {
+			uint64_t v = value;
+			args.value = &v;
+			args.length = sizeof(v);
+			cb(&args);
+		}
+	}
+	return total - size;
+}
+
+int
+sproto_decode(const struct sproto_type *st, const void * data, int size, sproto_callback cb, void *ud) {
+	return decode_message(st, data, size, NULL, cb, ud, 0);
+}
+
+int
+sproto_decode_trusted(const struct sproto_type *st, const void * data, int size, sproto_callback cb, void *ud) {
+	return decode_message(st, data, size, NULL, cb, ud, 1);
+}
+
+int
+sproto_decode_projection(const struct sproto_type *st, const void * data, int size, const struct sproto_projection *proj, sproto_callback cb, void *ud) {
+	return decode_message(st, data, size, proj, cb, ud, 0);
+}
+
+// verify
+
+static int verify_message(const struct sproto_type *st, const uint8_t * stream, int size, int key, int deep);
+
+static int
+verify_array(const struct field *f, const uint8_t * stream, uint32_t sz, int deep) {
+	int len;
+	if (sz == 0)
+		return 0;
+	switch (f->type & ~SPROTO_TARRAY) {
+	case SPROTO_TINTEGER:
+		len = stream[0];
+		if (len != SIZEOF_INT32 && len != SIZEOF_INT64)
+			return -1;
+		return (sz - 1) % len == 0 ? 0 : -1;
+	case SPROTO_TBOOLEAN:
+		return 0;
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT:
+		while (sz > 0) {
+			uint32_t hsz;
+			if (sz < SIZEOF_LENGTH)
+				return -1;
+			hsz = todword(stream);
+			stream += SIZEOF_LENGTH;
+			sz -= SIZEOF_LENGTH;
+			if (hsz > sz)
+				return -1;
+			// the element of a map must have the main index
+			if (f->type == (SPROTO_TSTRUCT | SPROTO_TARRAY) && verify_message(f->st, stream, hsz, f->key, deep) != hsz)
+				return -1;
+			stream += hsz;
+			sz -= hsz;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+// returns the bytes of the message, or -1 if any field would fail sproto_decode, or the field of tag key (-1 for none) is missing
+static int
+verify_message(const struct sproto_type *st, const uint8_t * stream, int size, int key, int deep) {
+	const uint8_t * datastream;
+	int total = size;
+	int fn, i, tag;
+	if (++deep > VERIFY_DEEPLEVEL)
+		return -1;
+	if (size < SIZEOF_HEADER)
+		return -1;
+	fn = toword(stream);
+	stream += SIZEOF_HEADER;
+	size -= SIZEOF_HEADER;
+	if (size < fn * SIZEOF_FIELD)
+		return -1;
+	datastream = stream + fn * SIZEOF_FIELD;
+	size -= fn * SIZEOF_FIELD;
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		const uint8_t * currentdata = datastream;
+		struct field * f;
+		uint32_t sz = 0;
+		int value = toword(stream + i * SIZEOF_FIELD);
+		++ tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		if (value == 0) {
+			if (size < SIZEOF_LENGTH)
+				return -1;
+			sz = todword(datastream);
+			if (sz > (uint32_t)(size - SIZEOF_LENGTH))
+				return -1;
+			datastream += sz+SIZEOF_LENGTH;
+			size -= sz+SIZEOF_LENGTH;
+		}
+		f = findtag(st, tag);
+		if (f == NULL)
+			continue;
+		if (tag == key)
+			key = -1;
+		if (value != 0) {
+			if (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN)
+				return -1;
+			continue;
+		}
+		currentdata += SIZEOF_LENGTH;
+		switch (f->type) {
+		case SPROTO_TINTEGER | SPROTO_TARRAY:
+		case SPROTO_TBOOLEAN | SPROTO_TARRAY:
+		case SPROTO_TSTRING | SPROTO_TARRAY:
+		case SPROTO_TSTRUCT | SPROTO_TARRAY:
+			if (verify_array(f, currentdata, sz, deep))
+				return -1;
+			break;
+		case SPROTO_TINTEGER:
+			if (sz != SIZEOF_INT32 && sz != SIZEOF_INT64)
+				return -1;
+			break;
+		case SPROTO_TSTRING:
+			break;
+		case SPROTO_TSTRUCT:
+			if (verify_message(f->st, currentdata, sz, -1, deep) != sz)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (key >= 0)
+		return -1;
+	return total - size;
+}
+
+int
+sproto_verify(const struct sproto_type *st, const void * data, int size) {
+	return verify_message(st, data, size, -1, 0);
+}
+
+// streaming decode
+
+#define DECODER_FN 0
+#define DECODER_HEADER 1
+#define DECODER_FIELD 2
+#define DECODER_LENGTH 3
+#define DECODER_SKIP 4
+#define DECODER_DATA 5
+#define DECODER_INTLEN 6
+#define DECODER_ELEMENT 7
+#define DECODER_OBJECT_LENGTH 8
+#define DECODER_OBJECT 9
+#define DECODER_ERROR 10
+#define DECODER_LIMIT 11
+
+struct sproto_decoder {
+	const struct sproto_type * st;
+	sproto_callback cb;
+	struct sproto_arg args;
+	int state;
+	const uint8_t * in;	// the segment being fed
+	int insz;
+	uint8_t * header;
+	int headercap;
+	uint8_t * buf;	// the bytes of a unit split across segments
+	int staged;
+	int bufcap;
+	int limit;	// the max bytes of a unit staged in buf, 0 for no limit
+	int fn;
+	int field;
+	int tag;
+	const struct field * f;
+	uint32_t remain;	// the bytes left in the field
+	uint32_t length;
+	int intlen;
+	int count;	// the count of elements in an integer or boolean array
+	int bulk;	// the callback asks for the elements in bulk
+	int nblock;	// elements in block
+	union {
+		int64_t i[BULK_BLOCK];
+		uint8_t b[BULK_BLOCK];
+	} block;
+};
+
+struct sproto_decoder *
+sproto_decoder_create(const struct sproto_type *st, sproto_callback cb, void *ud) {
+	struct sproto_decoder * d = (struct sproto_decoder *)malloc(sizeof(*d));
+	if (d == NULL)
+		return NULL;
+	d->st = st;
+	d->cb = cb;
+	d->args.ud = ud;
+	d->args.writer = NULL;
+	d->args.bulk = 0;
+	d->args.projection = NULL;
+	d->args.nest = 0;
+	d->header = NULL;
+	d->headercap = 0;
+	d->buf = NULL;
+	d->bufcap = 0;
+	d->limit = 0;
+	sproto_decoder_reset(d);
+	return d;
+}
+
+void
+sproto_decoder_release(struct sproto_decoder *d) {
+	if (d == NULL)
+		return;
+	free(d->header);
+	free(d->buf);
+	free(d);
+}
+
+void
+sproto_decoder_reset(struct sproto_decoder *d) {
+	d->state = DECODER_FN;
+	d->staged = 0;
+	d->args.bulk = 0;
+}
+
+void
+sproto_decoder_limit(struct sproto_decoder *d, const struct sproto_limit *limit) {
+	d->limit = limit ? limit->staged : 0;
+}
+
+static int
+decoder_reserve(uint8_t **p, int *cap, uint32_t sz) {
+	uint8_t * n;
+	if (sz <= *cap)
+		return 0;
+	if (sz > 0x7fffffff)
+		return -1;
+	n = (uint8_t *)realloc(*p, sz);
+	if (n == NULL)
+		return -1;
+	*p = n;
+	*cap = sz;
+	return 0;
+}
+
+// returns sz contiguous bytes, from the segment if the unit is not split, or NULL if more data is needed
+static const uint8_t *
+decoder_read(struct sproto_decoder *d, uint32_t sz) {
+	int n;
+	if (d->staged == 0 && d->insz >= sz) {
+		const uint8_t * p = d->in;
+		d->in += sz;
+		d->insz -= sz;
+		return p;
+	}
+	if (d->limit > 0 && sz > d->limit) {
+		d->state = DECODER_LIMIT;
+		return NULL;
+	}
+	if (decoder_reserve(&d->buf, &d->bufcap, sz)) {
+		d->state = DECODER_ERROR;
+		return NULL;
+	}
+	n = sz - d->staged;
+	if (n > d->insz)
+		n = d->insz;
+	memcpy(d->buf + d->staged, d->in, n);
+	d->in += n;
+	d->insz -= n;
+	d->staged += n;
+	if (d->staged < sz)
+		return NULL;
+	d->staged = 0;
+	return d->buf;
+}
+
+// deliver the elements collected in bulk mode
+static int
+decoder_flush(struct sproto_decoder *d, int index) {
+	int r;
+	if (d->nblock == 0)
+		return 0;
+	d->args.bulk = d->count;
+	d->args.index = index - d->nblock + 1;
+	if (d->args.type == SPROTO_TINTEGER) {
+		d->args.value = d->block.i;
+		d->args.length = d->nblock * sizeof(int64_t);
+	} else {
+		d->args.value = d->block.b;
+		d->args.length = d->nblock;
+	}
+	r = d->cb(&d->args);
+	d->args.bulk = 0;
+	d->nblock = 0;
+	return r ? -1 : 0;
+}
+
+// integer and boolean elements, the callback may switch to bulk mode on the first one
+static int
+decoder_element(struct sproto_decoder *d, const uint8_t *p) {
+	uint64_t v;
+	int index = d->count - d->remain / d->intlen;
+	if (d->bulk && p != d->buf) {
+		// in bulk mode, decode the element and the following ones in the segment together
+		int n = 1 + d->insz / d->intlen;
+		int sz;
+		if (n > 1 + d->remain / d->intlen)
+			n = 1 + d->remain / d->intlen;
+		if (n > BULK_BLOCK - d->nblock)
+			n = BULK_BLOCK - d->nblock;
+		if (d->intlen == SIZEOF_INT32) {
+			int32_expand(d->block.i + d->nblock, p, n);
+		} else if (d->intlen == SIZEOF_INT64) {
+			int64_load(d->block.i + d->nblock, p, n);
+		} else {
+			memcpy(d->block.b + d->nblock, p, n);
+		}
+		sz = (n - 1) * d->intlen;
+		d->in += sz;
+		d->insz -= sz;
+		d->remain -= sz;
+		d->nblock += n;
+		index += n - 1;
+		if (d->nblock == BULK_BLOCK)
+			return decoder_flush(d, index);
+		return 0;
+	}
+	if (d->intlen == SIZEOF_INT32) {
+		v = expand64(todword(p));
+	} else if (d->intlen == SIZEOF_INT64) {
+		v = (uint64_t)todword(p) | (uint64_t)todword(p + SIZEOF_INT32) << 32;
+	} else {
+		v = p[0];
+	}
+	if (d->bulk) {
+		if (d->args.type == SPROTO_TINTEGER) {
+			d->block.i[d->nblock++] = v;
+		} else {
+			d->block.b[d->nblock++] = v;
+		}
+		if (d->nblock == BULK_BLOCK)
+			return decoder_flush(d, index);
+		return 0;
+	}
+	d->args.index = index;
+	d->args.value = &v;
+	d->args.length = sizeof(v);
+	if (d->cb(&d->args) == SPROTO_CB_BULK && index == 1) {
+		if (d->args.type == SPROTO_TINTEGER) {
+			d->block.i[0] = v;
+		} else {
+			d->block.b[0] = v;
+		}
+		d->bulk = 1;
+		d->nblock = 1;
+	}
+	return 0;
+}
+
+static int
+decoder_field(struct sproto_decoder *d) {
+	const struct field * f;
+	int value = toword(d->header + d->field * SIZEOF_FIELD);
+	++d->field;
+	++d->tag;
+	if (value & 1) {
+		d->tag += value/2;
+		return 0;
+	}
+	value = value/2 - 1;
+	f = findtag(d->st, d->tag);
+	d->f = f;
+	if (value < 0) {
+		d->state = DECODER_LENGTH;
+		return 0;
+	}
+	if (f == NULL)
+		return 0;
+	if (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN)
+		return -1;
+	d->args.tagname = f->name;
+	d->args.tagid = f->tag;
+	d->args.type = f->type & ~SPROTO_TARRAY;
+	d->args.subtype = f->st;
+	d->args.index = 0;
+	d->args.mainindex = f->key;
+	d->args.extra = f->extra;
+	{
+		uint64_t v = value;
+		d->args.value = &v;
+		d->args.length = sizeof(v);
+		d->cb(&d->args);
+	}
+	return 0;
+}
+
+// the length of a data field is read, choose the state by the type
+static int
+decoder_data(struct sproto_decoder *d) {
+	const struct field * f = d->f;
+	if (f == NULL) {
+		d->state = DECODER_SKIP;
+		return 0;
+	}
+	d->args.tagname = f->name;
+	d->args.tagid = f->tag;
+	d->args.type = f->type & ~SPROTO_TARRAY;
+	d->args.subtype = f->st;
+	d->args.index = 0;
+	d->args.mainindex = f->key;
+	d->args.extra = f->extra;
+	switch (f->type) {
+	case SPROTO_TINTEGER:
+		if (d->remain != SIZEOF_INT32 && d->remain != SIZEOF_INT64)
+			return -1;
+		// go through
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT:
+		d->state = DECODER_DATA;
+		return 0;
+	case SPROTO_TINTEGER | SPROTO_TARRAY:
+	case SPROTO_TBOOLEAN | SPROTO_TARRAY:
+	case SPROTO_TSTRING | SPROTO_TARRAY:
+	case SPROTO_TSTRUCT | SPROTO_TARRAY:
+		if (d->remain == 0) {
+			// It's empty array, call cb with index == -1 to create the empty array.
+			d->args.index = -1;
+			d->args.value = NULL;
+			d->args.length = 0;
+			d->cb(&d->args);
+			d->state = DECODER_FIELD;
+			return 0;
+		}
+		d->bulk = 0;
+		d->nblock = 0;
+		d->count = 0;
+		if (d->args.type == SPROTO_TINTEGER) {
+			d->state = DECODER_INTLEN;
+		} else if (d->args.type == SPROTO_TBOOLEAN) {
+			d->intlen = 1;
+			d->count = d->remain;
+			d->state = DECODER_ELEMENT;
+		} else {
+			d->state = DECODER_OBJECT_LENGTH;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static int
+decoder_feed(struct sproto_decoder *d) {
+	const uint8_t * p;
+	uint32_t n;
+	for (;;) {
+		switch (d->state) {
+		case DECODER_FN:
+			if ((p = decoder_read(d, SIZEOF_HEADER)) == NULL)
+				return 0;
+			d->fn = toword(p);
+			d->field = 0;
+			d->tag = -1;
+			if (decoder_reserve(&d->header, &d->headercap, d->fn * SIZEOF_FIELD))
+				return -1;
+			d->state = DECODER_HEADER;
+			break;
+		case DECODER_HEADER:
+			if (d->fn > 0) {
+				if ((p = decoder_read(d, d->fn * SIZEOF_FIELD)) == NULL)
+					return 0;
+				memcpy(d->header, p, d->fn * SIZEOF_FIELD);
+			}
+			d->state = DECODER_FIELD;
+			break;
+		case DECODER_FIELD:
+			if (d->field >= d->fn)
+				return 1;
+			if (decoder_field(d))
+				return -1;
+			break;
+		case DECODER_LENGTH:
+			if ((p = decoder_read(d, SIZEOF_LENGTH)) == NULL)
+				return 0;
+			d->remain = todword(p);
+			if (decoder_data(d))
+				return -1;
+			break;
+		case DECODER_SKIP:
+			n = d->remain < d->insz ? d->remain : d->insz;
+			d->in += n;
+			d->insz -= n;
+			d->remain -= n;
+			if (d->remain > 0)
+				return 0;
+			d->state = DECODER_FIELD;
+			break;
+		case DECODER_DATA:
+			if ((p = decoder_read(d, d->remain)) == NULL)
+				return 0;
+			if (d->args.type == SPROTO_TINTEGER) {
+				uint64_t v;
+				if (d->remain == SIZEOF_INT32) {
+					v = expand64(todword(p));
+				} else {
+					v = (uint64_t)todword(p) | (uint64_t)todword(p + SIZEOF_INT32) << 32;
+				}
+				d->args.value = &v;
+				d->args.length = sizeof(v);
+				d->cb(&d->args);
+			} else {
+				d->args.value = (void *)p;
+				d->args.length = d->remain;
+				if (d->cb(&d->args))
+					return -1;
+			}
+			d->state = DECODER_FIELD;
+			break;
+		case DECODER_INTLEN:
+			if ((p = decoder_read(d, 1)) == NULL)
+				return 0;
+			d->intlen = p[0];
+			--d->remain;
+			if (d->intlen != SIZEOF_INT32 && d->intlen != SIZEOF_INT64)
+				return -1;
+			if (d->remain % d->intlen != 0)
+				return -1;
+			d->count = d->remain / d->intlen;
+			d->state = DECODER_ELEMENT;
+			break;
+		case DECODER_ELEMENT:
+			if (d->remain == 0) {
+				if (decoder_flush(d, d->count))
+					return -1;
+				d->state = DECODER_FIELD;
+				break;
+			}
+			if ((p = decoder_read(d, d->intlen)) == NULL)
+				return 0;
+			d->remain -= d->intlen;
+			if (decoder_element(d, p))
+				return -1;
+			break;
+		case DECODER_OBJECT_LENGTH:
+			if (d->remain == 0) {
+				d->state = DECODER_FIELD;
+				break;
+			}
+			if (d->remain < SIZEOF_LENGTH)
+				return -1;
+			if ((p = decoder_read(d, SIZEOF_LENGTH)) == NULL)
+				return 0;
+			d->remain -= SIZEOF_LENGTH;
+			d->length = todword(p);
+			if (d->length > d->remain)
+				return -1;
+			d->state = DECODER_OBJECT;
+			break;
+		case DECODER_OBJECT:
+			if ((p = decoder_read(d, d->length)) == NULL)
+				return 0;
+			d->remain -= d->length;
+			++d->count;
+			d->args.index = d->count;
+			d->args.value = (void *)p;
+			d->args.length = d->length;
+			if (d->cb(&d->args))
+				return -1;
+			d->state = DECODER_OBJECT_LENGTH;
+			break;
+		default:
+			return -1;
+		}
+	}
+}
+
+int
+sproto_decoder_feed(struct sproto_decoder *d, const void * data, int size) {
+	int r;
+	d->in = (const uint8_t *)data;
+	d->insz = size;
+	r = decoder_feed(d);
+	if (d->state == DECODER_LIMIT) {
+		d->args.bulk = 0;
+		return -2;
+	}
+	if (r < 0 || d->state == DECODER_ERROR) {
+		d->state = DECODER_ERROR;
+		d->args.bulk = 0;
+		return -1;
+	}
+	if (r == 0)
+		return 0;
+	// the message is done, begin the next one
+	d->state = DECODER_FN;
+	return size - d->insz;
+}
+
+// nested encode
+// The engine walks into the structs itself, the frames are on the heap instead of the C stack.
+// The callback returns SPROTO_CB_NEST for a struct (args->nest == 1), and it's called again with
+// args->nest == -1 after the struct is done.
+
+#define NEST_LOCALFRAME 16
+
+// push a frame, the frames move to the heap when local is full. returns the new top, or NULL
+static void *
+nest_push(void **stack, void *local, int *cap, int depth, size_t sz) {
+	char * s = (char *)*stack;
+	if (depth >= *cap) {
+		char * n = (char *)malloc(sz * *cap * 2);
+		if (n == NULL)
+			return NULL;
+		memcpy(n, s, sz * *cap);
+		if (s != local)
+			free(s);
+		*stack = s = n;
+		*cap *= 2;
+	}
+	return s + sz * depth;
+}
+
+struct encode_frame {
+	const struct sproto_type * st;
+	struct sproto_arg args;
+	uint8_t * header;
+	uint8_t * data;
+	int size;	// bytes left after data, may be negative in an array
+	int i;
+	int index;
+	int lasttag;
+	uint8_t * array;	// the length of the struct array being encoded, NULL if not in array
+};
+
+static int
+encode_frame_init(struct encode_frame *fr, const struct sproto_type *st, uint8_t *buffer, int size, void *ud) {
+	// reserve the records of all fields, and move the data at the end
+	int header_sz = SIZEOF_HEADER + st->maxn * SIZEOF_FIELD;
+	if (size < header_sz)
+		return -1;
+	fr->st = st;
+	fr->args.ud = ud;
+	fr->args.writer = NULL;
+	fr->args.bulk = 0;
+	fr->args.projection = NULL;
+	fr->args.nest = 0;
+	fr->header = buffer;
+	fr->data = buffer + header_sz;
+	fr->size = size - header_sz;
+	fr->i = 0;
+	fr->index = 0;
+	fr->lasttag = -1;
+	fr->array = NULL;
+	return 0;
+}
+
+// returns the size of the message
+static int
+encode_frame_close(struct encode_frame *fr) {
+	uint8_t * data = fr->header + SIZEOF_HEADER + fr->st->maxn * SIZEOF_FIELD;
+	int datasz = fr->data - data;
+	fr->header[0] = fr->index & 0xff;
+	fr->header[1] = (fr->index >> 8) & 0xff;
+	if (fr->index != fr->st->maxn) {
+		memmove(fr->header + SIZEOF_HEADER + fr->index * SIZEOF_FIELD, data, datasz);
+	}
+	return SIZEOF_HEADER + fr->index * SIZEOF_FIELD + datasz;
+}
+
+// the field is encoded in sz bytes of data (0 is nil), go to the next field
+static int
+encode_frame_next(struct encode_frame *fr, int sz, int value) {
+	const struct field *f = &fr->st->f[fr->i++];
+	if (sz == 0)
+		return 0;
+	if (value == 0) {
+		fr->data += sz;
+		fr->size -= sz;
+	}
+	return encode_record(fr->header + SIZEOF_HEADER, &fr->index, &fr->lasttag, f, value);
+}
+
+// returns 1 to walk into the struct, 0 for the next field, -1 on error
+static int
+encode_frame_field(struct encode_frame *fr, sproto_callback cb) {
+	const struct field *f = &fr->st->f[fr->i];
+	struct sproto_arg *args = &fr->args;
+	int value = 0;
+	int sz;
+	if (fr->array == NULL) {
+		args->tagname = f->name;
+		args->tagid = f->tag;
+		args->type = f->type & ~SPROTO_TARRAY;
+		args->subtype = f->st;
+		args->index = 0;
+		args->mainindex = f->key;
+		args->extra = f->extra;
+	}
+	switch (f->type) {
+	case SPROTO_TINTEGER:
+	case SPROTO_TBOOLEAN:
+		sz = encode_scalar(cb, args, fr->data, fr->size, &value);
+		if (sz == SPROTO_CB_NIL || sz == SPROTO_CB_NOARRAY)
+			sz = 0;
+		break;
+	case SPROTO_TSTRING:
+		sz = encode_object(cb, args, fr->data, fr->size);
+		break;
+	case SPROTO_TSTRUCT:
+		args->value = fr->data + SIZEOF_LENGTH;
+		args->length = fr->size < SIZEOF_LENGTH ? 0 : fr->size - SIZEOF_LENGTH;
+		args->nest = 1;
+		sz = cb(args);
+		args->nest = 0;
+		if (sz == SPROTO_CB_NEST)
+			return 1;
+		if (sz < 0) {
+			if (sz != SPROTO_CB_NIL)
+				return -1;
+			sz = 0;
+		} else {
+			if (fr->size < SIZEOF_LENGTH)
+				return -1;
+			sz = fill_size(fr->data, sz);
+		}
+		break;
+	default:
+		if (args->type != SPROTO_TSTRUCT) {
+			sz = encode_array(cb, args, fr->data, fr->size);
+			break;
+		}
+		if (fr->array == NULL) {
+			fr->array = fr->data;
+			fr->data += SIZEOF_LENGTH;
+			fr->size -= SIZEOF_LENGTH;
+			args->index = 1;
+		}
+		args->value = fr->data + SIZEOF_LENGTH;
+		args->length = fr->size < SIZEOF_LENGTH ? 0 : fr->size - SIZEOF_LENGTH;
+		args->nest = 1;
+		sz = cb(args);
+		args->nest = 0;
+		if (sz == SPROTO_CB_NEST)
+			return 1;
+		if (sz >= 0) {
+			if (fr->size < SIZEOF_LENGTH + sz)
+				return -1;
+			fill_size(fr->data, sz);
+			fr->data += SIZEOF_LENGTH + sz;
+			fr->size -= SIZEOF_LENGTH + sz;
+			++args->index;
+			return 0;
+		}
+		if (sz != SPROTO_CB_NIL && sz != SPROTO_CB_NOARRAY)
+			return -1;
+		// end of array, rewind data to the length of array
+		value = fr->data - fr->array;
+		fr->size += value;
+		fr->data = fr->array;
+		fr->array = NULL;
+		if (sz == SPROTO_CB_NOARRAY) {
+			sz = 0;
+		} else {
+			if (fr->size < value)
+				return -1;
+			sz = fill_size(fr->data, value - SIZEOF_LENGTH);
+		}
+		value = 0;
+		break;
+	}
+	if (sz < 0)
+		return -1;
+	return encode_frame_next(fr, sz, value);
+}
+
+int
+sproto_encode_nested(const struct sproto_type *st, void * buffer, int size, sproto_callback cb, void *ud) {
+	struct encode_frame local[NEST_LOCALFRAME];
+	void * stack = local;
+	int cap = NEST_LOCALFRAME;
+	int depth = 0;
+	int r = -1;
+	struct encode_frame * fr = local;
+	if (encode_frame_init(fr, st, (uint8_t *)buffer, size, ud))
+		return -1;
+	for (;;) {
+		int sz;
+		if (fr->i < fr->st->n) {
+			struct encode_frame * parent;
+			sz = encode_frame_field(fr, cb);
+			if (sz <= 0) {
+				if (sz < 0)
+					break;
+				continue;
+			}
+			// walk into the struct
+			fr = (struct encode_frame *)nest_push(&stack, local, &cap, ++depth, sizeof(*fr));
+			if (fr == NULL)
+				break;
+			parent = fr - 1;
+			if (encode_frame_init(fr, parent->args.subtype, parent->data + SIZEOF_LENGTH, parent->size - SIZEOF_LENGTH, ud))
+				break;
+			continue;
+		}
+		sz = encode_frame_close(fr);
+		if (depth == 0) {
+			r = sz;
+			break;
+		}
+		fr = (struct encode_frame *)stack + --depth;
+		fr->args.nest = -1;
+		fr->args.value = NULL;
+		fr->args.length = sz;
+		sz = cb(&fr->args);
+		fr->args.nest = 0;
+		if (sz != 0)
+			break;
+		sz = fill_size(fr->data, fr->args.length);
+		if (fr->array) {
+			fr->data += sz;
+			fr->size -= sz;
+			++fr->args.index;
+		} else if (encode_frame_next(fr, sz, 0)) {
+			break;
+		}
+	}
+	if (stack != local)
+		free(stack);
+	return r;
+}
+
+struct size_frame {
+	const struct sproto_type * st;
+	struct sproto_arg args;
+	int datasz;
+	int i;
+	int lasttag;
+	int array;	// the bytes of the struct array being sized, -1 if not in array
+};
+
+static void
+size_frame_init(struct size_frame *fr, const struct sproto_type *st, void *ud) {
+	fr->st = st;
+	fr->args.ud = ud;
+	fr->args.writer = NULL;
+	fr->args.bulk = 0;
+	fr->args.projection = NULL;
+	fr->args.nest = 0;
+	fr->datasz = 0;
+	fr->i = 0;
+	fr->lasttag = -1;
+	fr->array = -1;
+}
+
+// the field needs sz bytes of data (0 is nil), go to the next field
+static int
+size_frame_next(struct size_frame *fr, int sz, int inplace) {
+	const struct field *f = &fr->st->f[fr->i++];
+	if (sz == 0)
+		return 0;
+	if ((f->tag - fr->lasttag - 2) * 2 + 1 > 0xffff)
+		return -1;	// skip tag overflow, the same as sproto_encode
+	if (!inplace)
+		fr->datasz += sz;
+	fr->lasttag = f->tag;
+	return 0;
+}
+
+// returns 1 to walk into the struct, 0 for the next field, -1 on error
+static int
+size_frame_field(struct size_frame *fr, sproto_callback cb) {
+	const struct field *f = &fr->st->f[fr->i];
+	struct sproto_arg *args = &fr->args;
+	int inplace = 0;
+	int sz;
+	if (fr->array < 0) {
+		args->tagname = f->name;
+		args->tagid = f->tag;
+		args->type = f->type & ~SPROTO_TARRAY;
+		args->subtype = f->st;
+		args->index = 0;
+		args->mainindex = f->key;
+		args->extra = f->extra;
+	}
+	if (args->type != SPROTO_TSTRUCT) {
+		if (f->type & SPROTO_TARRAY) {
+			sz = size_array(cb, args);
+		} else if (args->type == SPROTO_TSTRING) {
+			sz = size_object(cb, args);
+		} else {
+			sz = size_scalar(cb, args, &inplace);
+			if (sz == SPROTO_CB_NIL || sz == SPROTO_CB_NOARRAY)
+				sz = 0;
+		}
+		if (sz < 0)
+			return -1;
+		return size_frame_next(fr, sz, inplace);
+	}
+	if ((f->type & SPROTO_TARRAY) && fr->array < 0) {
+		fr->array = 0;
+		args->index = 1;
+	}
+	args->value = NULL;
+	args->length = 0;
+	args->nest = 1;
+	sz = cb(args);
+	args->nest = 0;
+	if (sz == SPROTO_CB_NEST)
+		return 1;
+	if (fr->array < 0) {
+		if (sz < 0) {
+			if (sz != SPROTO_CB_NIL)
+				return -1;
+			return size_frame_next(fr, 0, 0);
+		}
+		return size_frame_next(fr, SIZEOF_LENGTH + sz, 0);
+	}
+	if (sz >= 0) {
+		fr->array += SIZEOF_LENGTH + sz;
+		++args->index;
+		return 0;
+	}
+	if (sz != SPROTO_CB_NIL && sz != SPROTO_CB_NOARRAY)
+		return -1;
+	// end of array
+	sz = sz == SPROTO_CB_NOARRAY ? 0 : SIZEOF_LENGTH + fr->array;
+	fr->array = -1;
+	return size_frame_next(fr, sz, 0);
+}
+
+/*
+	sproto_encode_size with the nested engine : the callback is invoked with args->nest == 1 and
+	args->value == NULL for a struct, it returns SPROTO_CB_NEST to walk into it, or the size of it.
+	sproto_encode_nested never fails with a buffer of the returned size.
+*/
+int
+sproto_encode_size_nested(const struct sproto_type *st, sproto_callback cb, void *ud) {
+	struct size_frame local[NEST_LOCALFRAME];
+	void * stack = local;
+	int cap = NEST_LOCALFRAME;
+	int depth = 0;
+	int r = -1;
+	struct size_frame * fr = local;
+	size_frame_init(fr, st, ud);
+	for (;;) {
+		int sz;
+		if (fr->i < fr->st->n) {
+			struct size_frame * parent;
+			sz = size_frame_field(fr, cb);
+			if (sz <= 0) {
+				if (sz < 0)
+					break;
+				continue;
+			}
+			// walk into the struct
+			fr = (struct size_frame *)nest_push(&stack, local, &cap, ++depth, sizeof(*fr));
+			if (fr == NULL)
+				break;
+			parent = fr - 1;
+			size_frame_init(fr, parent->args.subtype, ud);
+			continue;
+		}
+		sz = SIZEOF_HEADER + fr->st->maxn * SIZEOF_FIELD + fr->datasz;
+		if (depth == 0) {
+			r = sz;
+			break;
+		}
+		fr = (struct size_frame *)stack + --depth;
+		fr->args.nest = -1;
+		fr->args.value = NULL;
+		fr->args.length = sz;
+		if (cb(&fr->args) != 0)
+			break;
+		fr->args.nest = 0;
+		if (fr->array >= 0) {
+			fr->array += SIZEOF_LENGTH + sz;
+			++fr->args.index;
+		} else if (size_frame_next(fr, SIZEOF_LENGTH + sz, 0)) {
+			break;
+		}
+	}
+	if (stack != local)
+		free(stack);
+	return r;
+}
+
+struct decode_frame {
+	const struct sproto_type * st;
+	const struct sproto_projection * proj;
+	struct sproto_arg args;
+	uint8_t * stream;
+	uint8_t * datastream;
+	int size;	// bytes left after datastream
+	int total;
+	int fn;
+	int i;
+	int tag;
+	int selected;
+	uint8_t * array;	// the next element of the struct array being decoded, NULL if not in array
+	uint32_t arraysz;	// bytes left in the array
+};
+
+static int
+decode_frame_init(struct decode_frame *fr, const struct sproto_type *st, const struct sproto_projection *proj, uint8_t *data, int size, void *ud) {
+	if (size < SIZEOF_HEADER)
+		return -1;
+	fr->st = st;
+	fr->proj = proj;
+	fr->args.ud = ud;
+	fr->args.writer = NULL;
+	fr->args.bulk = 0;
+	fr->args.projection = NULL;
+	fr->args.nest = 0;
+	fr->fn = toword(data);
+	fr->stream = data + SIZEOF_HEADER;
+	fr->total = size;
+	size -= SIZEOF_HEADER;
+	if (size < fr->fn * SIZEOF_FIELD)
+		return -1;
+	fr->datastream = fr->stream + fr->fn * SIZEOF_FIELD;
+	fr->size = size - fr->fn * SIZEOF_FIELD;
+	fr->i = 0;
+	fr->tag = -1;
+	fr->selected = 0;
+	fr->array = NULL;
+	return 0;
+}
+
+// read the header of the next field, and fill args by it. returns 1 with the field and its data (value < 0),
+// or the value in the header (value >= 0), 0 to skip it, -1 on error, or 2 at the end of message
+static int
+decode_frame_next(struct decode_frame *fr, const struct field **pf, uint8_t **data, int *pvalue) {
+	const struct sproto_projection * proj = fr->proj;
+	struct sproto_arg *args = &fr->args;
+	const struct field * f;
+	int value;
+	if (fr->i >= fr->fn)
+		return 2;
+	value = toword(fr->stream + fr->i * SIZEOF_FIELD);
+	++fr->i;
+	++fr->tag;
+	if (value & 1) {
+		fr->tag += value/2;
+		return 0;
+	}
+	if (proj) {
+		while (fr->selected < proj->n && proj->tag[fr->selected] < fr->tag)
+			++fr->selected;
+		if (fr->selected == proj->n)	// all the selected tags are passed
+			return 2;
+	}
+	value = value/2 - 1;
+	*data = fr->datastream;
+	if (value < 0) {
+		uint32_t sz;
+		if (fr->size < SIZEOF_LENGTH)
+			return -1;
+		sz = todword(fr->datastream);
+		if (sz > (uint32_t)(fr->size - SIZEOF_LENGTH))
+			return -1;
+		fr->datastream += sz+SIZEOF_LENGTH;
+		fr->size -= sz+SIZEOF_LENGTH;
+	}
+	if (proj) {
+		if (proj->tag[fr->selected] != fr->tag)
+			return 0;
+		args->projection = proj->sub ? proj->sub[fr->selected] : NULL;
+	}
+	f = findtag(fr->st, fr->tag);
+	if (f == NULL)
+		return 0;
+	args->tagname = f->name;
+	args->tagid = f->tag;
+	args->type = f->type & ~SPROTO_TARRAY;
+	args->subtype = f->st;
+	args->index = 0;
+	args->mainindex = f->key;
+	args->extra = f->extra;
+	*pf = f;
+	*pvalue = value;
+	return 1;
+}
+
+// the integer field of 4 or 8 bytes, returns -1 if it's invalid
+static inline int
+decode_frame_integer(const uint8_t *data, uint64_t *v) {
+	uint32_t sz = todword(data);
+	if (sz == SIZEOF_INT32) {
+		*v = expand64(todword(data + SIZEOF_LENGTH));
+	} else if (sz == SIZEOF_INT64) {
+		*v = (uint64_t)todword(data + SIZEOF_LENGTH) | (uint64_t)todword(data + SIZEOF_LENGTH + SIZEOF_INT32) << 32;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// typed visitor
+// It walks into the structs with the frames on the heap, calls a typed entry for each value, and marks
+// the bounds of arrays with the count of elements.
+
+#define VISIT(vis, entry, ...) ((vis)->entry ? (vis)->entry(__VA_ARGS__) : 0)
+
+// the counters of a message decoded with limits
+struct visit_limit {
+	const struct sproto_limit * limit;	// NULL for no limit
+	int elements;
+	int string;
+};
+
+// count the elements and the bytes of strings, returns -2 if it exceeds the limit
+static inline int
+visit_count_limit(struct visit_limit *l, int elements, int string) {
+	const struct sproto_limit * limit = l->limit;
+	if (limit == NULL)
+		return 0;
+	l->elements += elements;
+	l->string += string;
+	if (limit->elements > 0 && l->elements > limit->elements)
+		return -2;
+	if (limit->string > 0 && l->string > limit->string)
+		return -2;
+	return 0;
+}
+
+// count the elements of string or struct array, -1 if it's invalid
+static int
+visit_count(const uint8_t * stream, uint32_t sz) {
+	int n = 0;
+	while (sz > 0) {
+		uint32_t hsz;
+		if (sz < SIZEOF_LENGTH)
+			return -1;
+		hsz = todword(stream);
+		stream += SIZEOF_LENGTH;
+		sz -= SIZEOF_LENGTH;
+		if (hsz > sz)
+			return -1;
+		stream += hsz;
+		sz -= hsz;
+		++n;
+	}
+	return n;
+}
+
+// visit an array, the elements of struct array are left to the frame. returns -1 on error, -2 over the limit
+static int
+visit_array(struct decode_frame *fr, const struct sproto_visitor *vis, struct visit_limit *l, uint8_t * stream) {
+	struct sproto_arg *args = &fr->args;
+	uint32_t sz = todword(stream);
+	int n, i;
+	stream += SIZEOF_LENGTH;
+	switch (args->type) {
+	case SPROTO_TINTEGER: {
+		int len;
+		if (sz == 0) {
+			n = 0;
+			break;
+		}
+		len = *stream;
+		++stream;
+		--sz;
+		if ((len != SIZEOF_INT32 && len != SIZEOF_INT64) || sz % len != 0)
+			return -1;
+		n = sz / len;
+		if (visit_count_limit(l, n, 0))
+			return -2;
+		if (VISIT(vis, on_array_begin, args, n))
+			return -1;
+		for (i=0;i<n;i++) {
+			uint64_t v;
+			if (len == SIZEOF_INT32) {
+				v = expand64(todword(stream + i*SIZEOF_INT32));
+			} else {
+				v = (uint64_t)todword(stream + i*SIZEOF_INT64) | (uint64_t)todword(stream + i*SIZEOF_INT64 + SIZEOF_INT32) << 32;
+			}
+			args->index = i+1;
+			if (VISIT(vis, on_integer, args, (long long)v))
+				return -1;
+		}
+		return VISIT(vis, on_array_end, args) ? -1 : 0;
+	}
+	case SPROTO_TBOOLEAN:
+		if (visit_count_limit(l, sz, 0))
+			return -2;
+		if (VISIT(vis, on_array_begin, args, sz))
+			return -1;
+		for (i=0;i<sz;i++) {
+			args->index = i+1;
+			if (VISIT(vis, on_boolean, args, stream[i]))
+				return -1;
+		}
+		return VISIT(vis, on_array_end, args) ? -1 : 0;
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT:
+		n = visit_count(stream, sz);
+		if (n < 0)
+			return -1;
+		if (visit_count_limit(l, n, args->type == SPROTO_TSTRING ? sz - n * SIZEOF_LENGTH : 0))
+			return -2;
+		if (args->type == SPROTO_TSTRUCT && n > 0) {
+			if (VISIT(vis, on_array_begin, args, n))
+				return -1;
+			fr->array = stream;
+			fr->arraysz = sz;
+			return 0;
+		}
+		break;
+	default:
+		return -1;
+	}
+	if (VISIT(vis, on_array_begin, args, n))
+		return -1;
+	for (i=0;i<n;i++) {
+		args->index = i+1;
+		if (VISIT(vis, on_string, args, stream + SIZEOF_LENGTH, todword(stream)))
+			return -1;
+		stream += todword(stream) + SIZEOF_LENGTH;
+	}
+	return VISIT(vis, on_array_end, args) ? -1 : 0;
+}
+
+// begin a struct, returns 1 to walk into it, 0 to skip, -1 on error
+static int
+visit_struct(struct sproto_arg *args, const struct sproto_visitor *vis) {
+	int r;
+	if (vis->on_struct_begin == NULL)
+		return 0;
+	r = vis->on_struct_begin(args);
+	if (r == 0)
+		return 1;
+	return r == SPROTO_CB_NIL ? 0 : -1;
+}
+
+// the next element of struct array, returns 1 to walk into it, 0 for the next, -1 on error
+static int
+visit_frame_element(struct decode_frame *fr, const struct sproto_visitor *vis) {
+	uint32_t hsz;
+	if (fr->arraysz == 0) {
+		fr->array = NULL;
+		return VISIT(vis, on_array_end, &fr->args) ? -1 : 0;
+	}
+	// the elements are checked by visit_count
+	hsz = todword(fr->array);
+	++fr->args.index;
+	fr->args.value = fr->array + SIZEOF_LENGTH;
+	fr->args.length = hsz;
+	fr->array += hsz + SIZEOF_LENGTH;
+	fr->arraysz -= hsz + SIZEOF_LENGTH;
+	return visit_struct(&fr->args, vis);
+}
+
+// returns 1 to walk into the struct, 0 for the next field, -1 on error, -2 over the limit, or 2 at the end of message
+static int
+visit_frame_field(struct decode_frame *fr, const struct sproto_visitor *vis, struct visit_limit *l) {
+	struct sproto_arg *args = &fr->args;
+	uint8_t * currentdata;
+	const struct field * f;
+	int value;
+	int r = decode_frame_next(fr, &f, &currentdata, &value);
+	if (r != 1)
+		return r;
+	if (value >= 0) {
+		if (f->type == SPROTO_TINTEGER)
+			return VISIT(vis, on_integer, args, value) ? -1 : 0;
+		if (f->type == SPROTO_TBOOLEAN)
+			return VISIT(vis, on_boolean, args, value) ? -1 : 0;
+		return -1;
+	}
+	switch (f->type) {
+	case SPROTO_TSTRUCT:
+		args->value = currentdata + SIZEOF_LENGTH;
+		args->length = todword(currentdata);
+		return visit_struct(args, vis);
+	case SPROTO_TINTEGER | SPROTO_TARRAY:
+	case SPROTO_TBOOLEAN | SPROTO_TARRAY:
+	case SPROTO_TSTRING | SPROTO_TARRAY:
+	case SPROTO_TSTRUCT | SPROTO_TARRAY:
+		return visit_array(fr, vis, l, currentdata);
+	case SPROTO_TSTRING:
+		if (visit_count_limit(l, 0, todword(currentdata)))
+			return -2;
+		return VISIT(vis, on_string, args, currentdata + SIZEOF_LENGTH, todword(currentdata)) ? -1 : 0;
+	case SPROTO_TINTEGER: {
+		uint64_t v;
+		if (decode_frame_integer(currentdata, &v))
+			return -1;
+		return VISIT(vis, on_integer, args, (long long)v) ? -1 : 0;
+	}
+	}
+	return -1;
+}
+
+int
+sproto_decode_limit(const struct sproto_type *st, const void * data, int size, const struct sproto_projection *proj, const struct sproto_visitor *vis, void *ud, const struct sproto_limit *limit) {
+	struct decode_frame local[NEST_LOCALFRAME];
+	void * stack = local;
+	int cap = NEST_LOCALFRAME;
+	int depth = 0;
+	int r = -1;
+	struct decode_frame * fr = local;
+	struct visit_limit l;
+	l.limit = limit;
+	l.elements = 0;
+	l.string = 0;
+	if (decode_frame_init(fr, st, proj, (uint8_t *)data, size, ud))
+		return -1;
+	for (;;) {
+		struct decode_frame * parent;
+		int sz = fr->array ? visit_frame_element(fr, vis) : visit_frame_field(fr, vis, &l);
+		if (sz == 0)
+			continue;
+		if (sz < 0) {
+			r = sz;
+			break;
+		}
+		if (sz == 1) {
+			if (limit && limit->depth > 0 && depth >= limit->depth) {
+				r = -2;
+				break;
+			}
+			// walk into the struct
+			fr = (struct decode_frame *)nest_push(&stack, local, &cap, ++depth, sizeof(*fr));
+			if (fr == NULL)
+				break;
+			parent = fr - 1;
+			if (decode_frame_init(fr, parent->args.subtype, parent->args.projection, parent->args.value, parent->args.length, ud))
+				break;
+			continue;
+		}
+		// end of message
+		sz = fr->total - fr->size;
+		if (depth == 0) {
+			r = sz;
+			break;
+		}
+		proj = fr->proj;
+		fr = (struct decode_frame *)stack + --depth;
+		if (sz != fr->args.length && proj == NULL)
+			break;
+		if (VISIT(vis, on_struct_end, &fr->args))
+			break;
+	}
+	if (stack != local)
+		free(stack);
+	return r;
+}
+
+int
+sproto_decode_visitor(const struct sproto_type *st, const void * data, int size, const struct sproto_projection *proj, const struct sproto_visitor *vis, void *ud) {
+	return sproto_decode_limit(st, data, size, proj, vis, ud, NULL);
+}
+
+// struct binding
+
+struct binding_field {
+	struct field *f;	// NULL if the field is not bound
+	int offset;
+	int size;
+	int count;
+	struct sproto_binding *sub;
+};
+
+struct sproto_binding {
+	struct sproto_binding *next;	// all the bindings made by one sproto_bind, the first one owns them
+	const struct sproto_type *st;
+	const struct sproto_struct_desc *desc;
+	int size;
+	struct binding_field *f;	// the same order as st->f
+};
+
+struct binding_memory {
+	uint8_t *ptr;
+	int sz;
+};
+
+static struct sproto_binding *
+bind_type(struct sproto_binding **list, const struct sproto_type *st, const struct sproto_struct_desc *desc) {
+	struct sproto_binding *b;
+	int i;
+	for (b = *list; b; b = b->next) {
+		// recursive types share the binding
+		if (b->st == st && b->desc == desc)
+			return b;
+	}
+	b = (struct sproto_binding *)malloc(sizeof(*b));
+	if (b == NULL)
+		return NULL;
+	b->st = st;
+	b->desc = desc;
+	b->size = desc->size;
+	b->f = (struct binding_field *)calloc(st->n > 0 ? st->n : 1, sizeof(struct binding_field));
+	if (b->f == NULL) {
+		free(b);
+		return NULL;
+	}
+	if (*list == NULL) {
+		b->next = NULL;
+		*list = b;
+	} else {
+		b->next = (*list)->next;
+		(*list)->next = b;
+	}
+	for (i=0;i<desc->n;i++) {
+		const struct sproto_field_desc *fd = &desc->f[i];
+		struct binding_field *bf = NULL;
+		int j;
+		for (j=0;j<st->n;j++) {
+			if (strcmp(st->f[j].name, fd->name) == 0) {
+				bf = &b->f[j];
+				break;
+			}
+		}
+		if (bf == NULL || bf->f != NULL)
+			return NULL;	// unknown or duplicated field
+		bf->f = &st->f[j];
+		bf->offset = fd->offset;
+		bf->size = fd->size;
+		bf->count = fd->count;
+		switch (bf->f->type & ~SPROTO_TARRAY) {
+		case SPROTO_TINTEGER:
+		case SPROTO_TBOOLEAN:
+			if (fd->size != 1 && fd->size != 2 && fd->size != 4 && fd->size != 8)
+				return NULL;
+			break;
+		case SPROTO_TSTRUCT:
+			if (fd->sub == NULL)
+				return NULL;
+			bf->sub = bind_type(list, bf->f->st, fd->sub);
+			if (bf->sub == NULL)
+				return NULL;
+			break;
+		}
+	}
+	return b;
+}
+
+struct sproto_binding *
+sproto_bind(const struct sproto_type *st, const struct sproto_struct_desc *desc) {
+	struct sproto_binding *list = NULL;
+	if (bind_type(&list, st, desc) == NULL) {
+		sproto_binding_release(list);
+		return NULL;
+	}
+	return list;
+}
+
+void
+sproto_binding_release(struct sproto_binding *b) {
+	while (b) {
+		struct sproto_binding *next = b->next;
+		free(b->f);
+		free(b);
+		b = next;
+	}
+}
+
+static int64_t
+bind_getint(const uint8_t *p, int size) {
+	switch (size) {
+	case 1:
+		return *(const int8_t *)p;
+	case 2: {
+		int16_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	case 4: {
+		int32_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	default: {
+		int64_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	}
+}
+
+static void
+bind_setint(uint8_t *p, int size, int64_t v) {
+	switch (size) {
+	case 1:
+		*(int8_t *)p = (int8_t)v;
+		break;
+	case 2: {
+		int16_t v16 = (int16_t)v;
+		memcpy(p, &v16, sizeof(v16));
+		break;
+	}
+	case 4: {
+		int32_t v32 = (int32_t)v;
+		memcpy(p, &v32, sizeof(v32));
+		break;
+	}
+	default:
+		memcpy(p, &v, sizeof(v));
+		break;
+	}
+}
+
+static int bind_encode(const struct sproto_binding *b, const uint8_t *obj, uint8_t *buffer, int size);
+
+static int
+bind_encode_array(const struct binding_field *bf, const uint8_t *obj, uint8_t *data, int size) {
+	const uint8_t *ptr;
+	uint8_t *buffer;
+	int n;
+	int i;
+	memcpy(&ptr, obj + bf->offset, sizeof(ptr));
+	if (ptr == NULL)
+		return 0;	// no array
+	memcpy(&n, obj + bf->count, sizeof(n));
+	if (n < 0 || size < SIZEOF_LENGTH)
+		return -1;
+	size -= SIZEOF_LENGTH;
+	buffer = data + SIZEOF_LENGTH;
+	if (n == 0)
+		return fill_size(data, 0);
+	switch (bf->f->type & ~SPROTO_TARRAY) {
+	case SPROTO_TINTEGER: {
+		int intlen = SIZEOF_INT32;
+		if (bf->size == SIZEOF_INT64) {
+			const int64_t * v = (const int64_t *)ptr;
+			intlen = int64_width(v, n);
+			if (size < 1 || (size - 1) / intlen < n)
+				return -1;
+			*buffer++ = (uint8_t)intlen;
+			if (intlen == SIZEOF_INT32) {
+				int64_narrow(buffer, v, n);
+			} else {
+				int64_store(buffer, v, n);
+			}
+			buffer += n * intlen;
+			break;
+		}
+		for (i=0;i<n;i++) {
+			int64_t v = bind_getint(ptr + i * bf->size, bf->size);
+			if (v != (int32_t)v) {
+				intlen = SIZEOF_INT64;
+				break;
+			}
+		}
+		if (size < 1 || (size - 1) / intlen < n)
+			return -1;
+		*buffer++ = (uint8_t)intlen;
+		for (i=0;i<n;i++) {
+			uint64_t v = (uint64_t)bind_getint(ptr + i * bf->size, bf->size);
+			buffer[0] = v & 0xff;
+			buffer[1] = (v >> 8) & 0xff;
+			buffer[2] = (v >> 16) & 0xff;
+			buffer[3] = (v >> 24) & 0xff;
+			if (intlen == SIZEOF_INT64) {
+				buffer[4] = (v >> 32) & 0xff;
+				buffer[5] = (v >> 40) & 0xff;
+				buffer[6] = (v >> 48) & 0xff;
+				buffer[7] = (v >> 56) & 0xff;
+			}
+			buffer += intlen;
+		}
+		break;
+	}
+	case SPROTO_TBOOLEAN:
+		if (size < n)
+			return -1;
+		for (i=0;i<n;i++) {
+			buffer[i] = bind_getint(ptr + i * bf->size, bf->size) ? 1 : 0;
+		}
+		buffer += n;
+		break;
+	case SPROTO_TSTRING:
+		for (i=0;i<n;i++) {
+			struct sproto_string str;
+			memcpy(&str, ptr + i * sizeof(str), sizeof(str));
+			if (str.sz < 0 || (str.str == NULL && str.sz > 0))
+				return -1;
+			if (size < SIZEOF_LENGTH || size - SIZEOF_LENGTH < str.sz)
+				return -1;
+			memcpy(buffer + SIZEOF_LENGTH, str.str, str.sz);
+			fill_size(buffer, str.sz);
+			buffer += SIZEOF_LENGTH + str.sz;
+			size -= SIZEOF_LENGTH + str.sz;
+		}
+		break;
+	case SPROTO_TSTRUCT:
+		for (i=0;i<n;i++) {
+			int sz;
+			if (size < SIZEOF_LENGTH)
+				return -1;
+			sz = bind_encode(bf->sub, ptr + i * bf->sub->size, buffer + SIZEOF_LENGTH, size - SIZEOF_LENGTH);
+			if (sz < 0)
+				return -1;
+			fill_size(buffer, sz);
+			buffer += SIZEOF_LENGTH + sz;
+			size -= SIZEOF_LENGTH + sz;
+		}
+		break;
+	default:
+		return -1;
+	}
+	return fill_size(data, buffer - (data + SIZEOF_LENGTH));
+}
+
+static int
+bind_encode(const struct sproto_binding *b, const uint8_t *obj, uint8_t *buffer, int size) {
+	const struct sproto_type *st = b->st;
+	uint8_t * header = buffer;
+	uint8_t * data;
+	int header_sz = SIZEOF_HEADER + st->maxn * SIZEOF_FIELD;
+	int i;
+	int index;
+	int lasttag;
+	int datasz;
+	if (size < header_sz)
+		return -1;
+	data = header + header_sz;
+	size -= header_sz;
+	index = 0;
+	lasttag = -1;
+	for (i=0;i<st->n;i++) {
+		const struct binding_field *bf = &b->f[i];
+		const uint8_t *p = obj + bf->offset;
+		int value = 0;
+		int sz;
+		uint8_t * record;
+		if (bf->f == NULL)
+			continue;
+		if (bf->f->type & SPROTO_TARRAY) {
+			sz = bind_encode_array(bf, obj, data, size);
+		} else {
+			switch (bf->f->type) {
+			case SPROTO_TINTEGER: {
+				int64_t v = bind_getint(p, bf->size);
+				if (v == (int32_t)v) {
+					uint32_t u32 = (uint32_t)v;
+					if (u32 < 0x7fff) {
+						value = (u32+1) * 2;
+						sz = 2;
+					} else {
+						sz = encode_integer(u32, data, size);
+					}
+				} else {
+					sz = encode_uint64((uint64_t)v, data, size);
+				}
+				break;
+			}
+			case SPROTO_TBOOLEAN:
+				value = bind_getint(p, bf->size) ? 4 : 2;
+				sz = 2;
+				break;
+			case SPROTO_TSTRING: {
+				struct sproto_string str;
+				memcpy(&str, p, sizeof(str));
+				if (str.str == NULL)
+					continue;	// nil string
+				if (str.sz < 0 || size < SIZEOF_LENGTH || size - SIZEOF_LENGTH < str.sz)
+					return -1;
+				memcpy(data + SIZEOF_LENGTH, str.str, str.sz);
+				sz = fill_size(data, str.sz);
+				break;
+			}
+			case SPROTO_TSTRUCT:
+				if (size < SIZEOF_LENGTH)
+					return -1;
+				sz = bind_encode(bf->sub, p, data + SIZEOF_LENGTH, size - SIZEOF_LENGTH);
+				if (sz < 0)
+					return -1;
+				sz = fill_size(data, sz);
+				break;
+			default:
+				return -1;
+			}
+		}
+		if (sz < 0)
+			return -1;
+		if (sz == 0)
+			continue;
+		if (value == 0) {
+			data += sz;
+			size -= sz;
+		}
+		record = header+SIZEOF_HEADER+SIZEOF_FIELD*index;
+		if (bf->f->tag > lasttag + 1) {
+			int skip = (bf->f->tag - lasttag - 2) * 2 + 1;
+			if (skip > 0xffff)
+				return -1;
+			record[0] = skip & 0xff;
+			record[1] = (skip >> 8) & 0xff;
+			++index;
+			record += SIZEOF_FIELD;
+		}
+		++index;
+		record[0] = value & 0xff;
+		record[1] = (value >> 8) & 0xff;
+		lasttag = bf->f->tag;
+	}
+	header[0] = index & 0xff;
+	header[1] = (index >> 8) & 0xff;
+
+	datasz = data - (header + header_sz);
+	data = header + header_sz;
+	if (index != st->maxn) {
+		memmove(header + SIZEOF_HEADER + index * SIZEOF_FIELD, data, datasz);
+	}
+	return SIZEOF_HEADER + index * SIZEOF_FIELD + datasz;
+}
+
+int
+sproto_encode_struct(const struct sproto_binding *b, const void * obj, void * buffer, int size) {
+	return bind_encode(b, (const uint8_t *)obj, (uint8_t *)buffer, size);
+}
+
+static void *
+bind_alloc(struct binding_memory *m, int sz) {
+	int align = (int)((8 - ((size_t)m->ptr & 7)) & 7);
+	uint8_t * ptr;
+	if (m->sz < align || m->sz - align < sz)
+		return NULL;
+	ptr = m->ptr + align;
+	m->ptr = ptr + sz;
+	m->sz -= align + sz;
+	memset(ptr, 0, sz);
+	return ptr;
+}
+
+static int bind_decode(const struct sproto_binding *b, const uint8_t *data, int size, uint8_t *obj, struct binding_memory *m, int deep);
+
+static int
+bind_decode_array(const struct binding_field *bf, uint8_t * stream, uint8_t *obj, struct binding_memory *m, int deep) {
+	uint32_t sz = todword(stream);
+	uint8_t * ptr;
+	int n = 0;
+	int i;
+	if (sz == 0) {
+		// empty array, a non-NULL pointer with zero count
+		ptr = bind_alloc(m, 0);
+		if (ptr == NULL)
+			return -1;
+		memcpy(obj + bf->offset, &ptr, sizeof(ptr));
+		memcpy(obj + bf->count, &n, sizeof(n));
+		return 0;
+	}
+	switch (bf->f->type & ~SPROTO_TARRAY) {
+	case SPROTO_TINTEGER: {
+		uint8_t * s = stream + SIZEOF_LENGTH + 1;
+		int len = s[-1];
+		--sz;
+		if ((len != SIZEOF_INT32 && len != SIZEOF_INT64) || sz % len != 0)
+			return -1;
+		n = sz / len;
+		if (n > 0x7fffffff / bf->size)
+			return -1;
+		ptr = bind_alloc(m, n * bf->size);
+		if (ptr == NULL)
+			return -1;
+		if (bf->size == SIZEOF_INT64) {
+			if (len == SIZEOF_INT32) {
+				int32_expand((int64_t *)ptr, s, n);
+			} else {
+				int64_load((int64_t *)ptr, s, n);
+			}
+			break;
+		}
+		for (i=0;i<n;i++) {
+			uint64_t v;
+			if (len == SIZEOF_INT32) {
+				v = expand64(todword(s + i * SIZEOF_INT32));
+			} else {
+				uint64_t low = todword(s + i * SIZEOF_INT64);
+				uint64_t hi = todword(s + i * SIZEOF_INT64 + SIZEOF_INT32);
+				v = low | hi << 32;
+			}
+			bind_setint(ptr + i * bf->size, bf->size, (int64_t)v);
+		}
+		break;
+	}
+	case SPROTO_TBOOLEAN:
+		n = sz;
+		if (n < 0 || n > 0x7fffffff / bf->size)
+			return -1;
+		ptr = bind_alloc(m, n * bf->size);
+		if (ptr == NULL)
+			return -1;
+		for (i=0;i<n;i++) {
+			bind_setint(ptr + i * bf->size, bf->size, stream[SIZEOF_LENGTH + i]);
+		}
+		break;
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT: {
+		int esz = (bf->f->type & ~SPROTO_TARRAY) == SPROTO_TSTRING ? (int)sizeof(struct sproto_string) : bf->sub->size;
+		uint8_t * s = stream + SIZEOF_LENGTH;
+		n = count_array(stream);
+		if (n < 0 || (esz > 0 && n > 0x7fffffff / esz))
+			return -1;
+		ptr = bind_alloc(m, n * esz);
+		if (ptr == NULL)
+			return -1;
+		for (i=0;i<n;i++) {
+			uint32_t hsz = todword(s);
+			s += SIZEOF_LENGTH;
+			if (bf->sub == NULL) {
+				struct sproto_string str;
+				str.str = (const char *)s;
+				str.sz = (int)hsz;
+				memcpy(ptr + i * esz, &str, sizeof(str));
+			} else if (bind_decode(bf->sub, s, hsz, ptr + i * esz, m, deep) < 0) {
+				return -1;
+			}
+			s += hsz;
+		}
+		break;
+	}
+	default:
+		return -1;
+	}
+	memcpy(obj + bf->offset, &ptr, sizeof(ptr));
+	memcpy(obj + bf->count, &n, sizeof(n));
+	return 0;
+}
+
+static int
+bind_decode(const struct sproto_binding *b, const uint8_t *data, int size, uint8_t *obj, struct binding_memory *m, int deep) {
+	const struct sproto_type *st = b->st;
+	int total = size;
+	uint8_t * stream;
+	uint8_t * datastream;
+	int fn;
+	int i;
+	int tag;
+	if (++deep > BIND_DEEPLEVEL)
+		return -1;
+	if (size < SIZEOF_HEADER)
+		return -1;
+	stream = (uint8_t *)data;
+	fn = toword(stream);
+	stream += SIZEOF_HEADER;
+	size -= SIZEOF_HEADER;
+	if (size < fn * SIZEOF_FIELD)
+		return -1;
+	datastream = stream + fn * SIZEOF_FIELD;
+	size -= fn * SIZEOF_FIELD;
+
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		uint8_t * currentdata;
+		struct field * f;
+		const struct binding_field *bf;
+		uint8_t * p;
+		int value = toword(stream + i * SIZEOF_FIELD);
+		++ tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		value = value/2 - 1;
+		currentdata = datastream;
+		if (value < 0) {
+			uint32_t sz;
+			if (size < SIZEOF_LENGTH)
+				return -1;
+			sz = todword(datastream);
+			if (sz > (uint32_t)(size - SIZEOF_LENGTH))
+				return -1;
+			datastream += sz+SIZEOF_LENGTH;
+			size -= sz+SIZEOF_LENGTH;
+		}
+		f = findtag(st, tag);
+		if (f == NULL)
+			continue;
+		bf = &b->f[f - st->f];
+		if (bf->f == NULL)
+			continue;
+		p = obj + bf->offset;
+		if (value < 0) {
+			if (f->type & SPROTO_TARRAY) {
+				if (bind_decode_array(bf, currentdata, obj, m, deep))
+					return -1;
+			} else {
+				uint32_t sz = todword(currentdata);
+				switch (f->type) {
+				case SPROTO_TINTEGER:
+					if (sz == SIZEOF_INT32) {
+						bind_setint(p, bf->size, (int64_t)expand64(todword(currentdata + SIZEOF_LENGTH)));
+					} else if (sz == SIZEOF_INT64) {
+						uint32_t low = todword(currentdata + SIZEOF_LENGTH);
+						uint32_t hi = todword(currentdata + SIZEOF_LENGTH + sizeof(uint32_t));
+						bind_setint(p, bf->size, (int64_t)((uint64_t)low | (uint64_t) hi << 32));
+					} else {
+						return -1;
+					}
+					break;
+				case SPROTO_TSTRING: {
+					struct sproto_string str;
+					str.str = (const char *)currentdata + SIZEOF_LENGTH;
+					str.sz = (int)sz;
+					memcpy(p, &str, sizeof(str));
+					break;
+				}
+				case SPROTO_TSTRUCT:
+					if (bind_decode(bf->sub, currentdata + SIZEOF_LENGTH, sz, p, m, deep) < 0)
+						return -1;
+					break;
+				default:
+					return -1;
+				}
+			}
+		} else if (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN) {
+			return -1;
+		} else {
+			bind_setint(p, bf->size, value);
+		}
+	}
+	return total - size;
+}
+
+int
+sproto_decode_struct(const struct sproto_binding *b, const void * data, int size, void * obj, void * mem, int memsz) {
+	struct binding_memory m;
+	m.ptr = (uint8_t *)mem;
+	m.sz = mem == NULL ? 0 : memsz;
+	memset(obj, 0, b->size);
+	return bind_decode(b, (const uint8_t *)data, size, (uint8_t *)obj, &m, 0);
+}
+
+// view
+
+struct view_slot {
+	int value;	// the value in header, -1 if it's in data part
+	const uint8_t * data;	// the data with length prefix, NULL if the field is not exist
+};
+
+struct sproto_view {
+	const struct sproto_type * st;
+	const uint8_t * data;
+	int sz;
+	struct view_slot slot[1];	// st->n slots, the same order as st->f
+};
+
+int
+sproto_view_size(const struct sproto_type *st) {
+	int n = st->n > 0 ? st->n : 1;
+	return (int)(sizeof(struct sproto_view) + (n - 1) * sizeof(struct view_slot));
+}
+
+/*
+	ã
+		ɨһϢͷÿfieldֵݵλã֮԰tagʣ
+	أ
+		viewϢʽbufferʱNULL
+*/
+struct sproto_view *
+sproto_view_init(void * buffer, int bufsz, const struct sproto_type *st, const void * data, int size) {
+	struct sproto_view * v = (struct sproto_view *)buffer;
+	const uint8_t * stream;
+	const uint8_t * datastream;
+	int total = size;
+	int fn;
+	int i;
+	int tag;
+	if (bufsz < sproto_view_size(st) || size < SIZEOF_HEADER)
+		return NULL;
+	v->st = st;
+	v->data = (const uint8_t *)data;
+	for (i=0;i<st->n;i++) {
+		v->slot[i].value = -1;
+		v->slot[i].data = NULL;
+	}
+	stream = (const uint8_t *)data;
+	fn = toword(stream);
+	stream += SIZEOF_HEADER;
+	size -= SIZEOF_HEADER;
+	if (size < fn * SIZEOF_FIELD)
+		return NULL;
+	datastream = stream + fn * SIZEOF_FIELD;
+	size -= fn * SIZEOF_FIELD;
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		const uint8_t * currentdata = datastream;
+		struct field * f;
+		int value = toword(stream + i * SIZEOF_FIELD);
+		++ tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		value = value/2 - 1;
+		if (value < 0) {
+			uint32_t sz;
+			if (size < SIZEOF_LENGTH)
+				return NULL;
+			sz = todword(datastream);
+			if (sz > (uint32_t)(size - SIZEOF_LENGTH))
+				return NULL;
+			datastream += sz+SIZEOF_LENGTH;
+			size -= sz+SIZEOF_LENGTH;
+		}
+		f = findtag(st, tag);
+		if (f == NULL)
+			continue;
+		if (value >= 0) {
+			if (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN)
+				return NULL;
+			v->slot[f - st->f].value = value;
+		}
+		// data is not NULL for the existing field
+		v->slot[f - st->f].data = currentdata;
+	}
+	v->sz = total - size;
+	return v;
+}
+
+int
+sproto_view_lookup(const struct sproto_type *st, const char * name, struct sproto_view_field *vf) {
+	int i;
+	for (i=0;i<st->n;i++) {
+		struct field *f = &st->f[i];
+		if (strcmp(f->name, name) == 0) {
+			vf->tag = f->tag;
+			vf->type = f->type & ~SPROTO_TARRAY;
+			vf->array = (f->type & SPROTO_TARRAY) ? 1 : 0;
+			vf->extra = f->extra;
+			vf->subtype = f->st;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// the slot of tag, NULL if the field is not exist
+static const struct view_slot *
+view_slot(const struct sproto_view *v, int tag, struct field **pf) {
+	struct field * f = findtag(v->st, tag);
+	const struct view_slot * slot;
+	if (f == NULL)
+		return NULL;
+	slot = &v->slot[f - v->st->f];
+	if (slot->data == NULL)
+		return NULL;
+	*pf = f;
+	return slot;
+}
+
+// the length prefixed element index (base 1) of string or struct array
+static const uint8_t *
+view_element(const uint8_t * stream, int index, uint32_t *sz) {
+	uint32_t length = todword(stream);
+	stream += SIZEOF_LENGTH;
+	while (length > 0) {
+		uint32_t hsz;
+		if (length < SIZEOF_LENGTH)
+			return NULL;
+		hsz = todword(stream);
+		if (hsz > length - SIZEOF_LENGTH)
+			return NULL;
+		if (--index == 0) {
+			*sz = hsz;
+			return stream + SIZEOF_LENGTH;
+		}
+		stream += SIZEOF_LENGTH + hsz;
+		length -= SIZEOF_LENGTH + hsz;
+	}
+	return NULL;
+}
+
+int
+sproto_view_count(const struct sproto_view *v, int tag) {
+	struct field * f;
+	const struct view_slot * slot = view_slot(v, tag, &f);
+	uint32_t sz;
+	if (slot == NULL)
+		return SPROTO_CB_NIL;
+	if (!(f->type & SPROTO_TARRAY))
+		return SPROTO_CB_ERROR;
+	sz = todword(slot->data);
+	if (sz == 0)
+		return 0;
+	switch (f->type & ~SPROTO_TARRAY) {
+	case SPROTO_TINTEGER: {
+		int intlen = slot->data[SIZEOF_LENGTH];
+		if ((intlen != SIZEOF_INT32 && intlen != SIZEOF_INT64) || (sz - 1) % intlen != 0)
+			return SPROTO_CB_ERROR;
+		return (sz - 1) / intlen;
+	}
+	case SPROTO_TBOOLEAN:
+		return sz;
+	default: {
+		int n = count_array(slot->data);
+		return n < 0 ? SPROTO_CB_ERROR : n;
+	}
+	}
+}
+
+int
+sproto_view_integer(const struct sproto_view *v, int tag, int index, long long *value) {
+	struct field * f;
+	const struct view_slot * slot = view_slot(v, tag, &f);
+	const uint8_t * p;
+	uint32_t sz;
+	if (slot == NULL)
+		return SPROTO_CB_NIL;
+	if ((f->type & ~SPROTO_TARRAY) != SPROTO_TINTEGER || (index > 0) != ((f->type & SPROTO_TARRAY) != 0))
+		return SPROTO_CB_ERROR;
+	if (slot->value >= 0) {
+		*value = slot->value;
+		return 0;
+	}
+	sz = todword(slot->data);
+	p = slot->data + SIZEOF_LENGTH;
+	if (index > 0) {
+		int n = sproto_view_count(v, tag);
+		if (n < 0)
+			return n;
+		if (index > n)
+			return SPROTO_CB_NIL;
+		sz = p[0];
+		p += 1 + (index - 1) * sz;
+	}
+	if (sz == SIZEOF_INT32) {
+		*value = (long long)(int64_t)expand64(todword(p));
+	} else if (sz == SIZEOF_INT64) {
+		uint64_t low = todword(p);
+		uint64_t hi = todword(p + SIZEOF_INT32);
+		*value = (long long)(int64_t)(low | hi << 32);
+	} else {
+		return SPROTO_CB_ERROR;
+	}
+	return 0;
+}
+
+int
+sproto_view_boolean(const struct sproto_view *v, int tag, int index, int *value) {
+	struct field * f;
+	const struct view_slot * slot = view_slot(v, tag, &f);
+	if (slot == NULL)
+		return SPROTO_CB_NIL;
+	if ((f->type & ~SPROTO_TARRAY) != SPROTO_TBOOLEAN || (index > 0) != ((f->type & SPROTO_TARRAY) != 0))
+		return SPROTO_CB_ERROR;
+	if (index > 0) {
+		if (index > (int)todword(slot->data))
+			return SPROTO_CB_NIL;
+		*value = slot->data[SIZEOF_LENGTH + index - 1] ? 1 : 0;
+		return 0;
+	}
+	if (slot->value < 0)
+		return SPROTO_CB_ERROR;
+	*value = slot->value ? 1 : 0;
+	return 0;
+}
+
+int
+sproto_view_string(const struct sproto_view *v, int tag, int index, const void ** str, int *sz) {
+	struct field * f;
+	const struct view_slot * slot = view_slot(v, tag, &f);
+	int type;
+	if (slot == NULL)
+		return SPROTO_CB_NIL;
+	type = f->type & ~SPROTO_TARRAY;
+	if ((type != SPROTO_TSTRING && type != SPROTO_TSTRUCT) || (index > 0) != ((f->type & SPROTO_TARRAY) != 0))
+		return SPROTO_CB_ERROR;
+	if (index > 0) {
+		uint32_t hsz;
+		const uint8_t * p = view_element(slot->data, index, &hsz);
+		if (p == NULL)
+			return SPROTO_CB_NIL;
+		*str = p;
+		*sz = (int)hsz;
+	} else {
+		*str = slot->data + SIZEOF_LENGTH;
+		*sz = (int)todword(slot->data);
+	}
+	return 0;
+}
+
+struct sproto_view *
+sproto_view_struct(const struct sproto_view *v, int tag, int index, void * buffer, int bufsz) {
+	struct field * f;
+	const void * data;
+	int sz;
+	if (sproto_view_string(v, tag, index, &data, &sz) != 0)
+		return NULL;
+	f = findtag(v->st, tag);
+	if ((f->type & ~SPROTO_TARRAY) != SPROTO_TSTRUCT)
+		return NULL;
+	return sproto_view_init(buffer, bufsz, f->st, data, sz);
+}
+
+// 0 pack
+
+// the words (of 8 bytes) scanned at once
+#define PACK_BLOCK 4
+
+#if defined(SPROTO_SIMD_DISPATCH)
+
+static int simd_ssse3 = 0;
+static int simd_avx2 = 0;
+
+// runs when the library is loaded, so the flags are never written while packing
+static void __attribute__((constructor))
+simd_init(void) {
+	__builtin_cpu_init();
+	simd_ssse3 = __builtin_cpu_supports("ssse3");
+	simd_avx2 = __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+// the bits of nonzero bytes of a word
+static inline int
+pack_mask(const uint8_t *src) {
+	int header = 0;
+	int i;
+	for (i=0;i<8;i++) {
+		header |= (src[i] != 0) << i;
+	}
+	return header;
+}
+
+#if defined(SPROTO_AVX2) || defined(SPROTO_SIMD_DISPATCH)
+
+static inline SIMD_TARGET("avx2") void
+pack_header_avx2(const uint8_t *src, uint8_t header[PACK_BLOCK]) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)src);
+	uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+	header[0] = m & 0xff;
+	header[1] = (m >> 8) & 0xff;
+	header[2] = (m >> 16) & 0xff;
+	header[3] = m >> 24;
+}
+
+#endif
+
+// the headers of PACK_BLOCK words
+static inline void
+pack_header(const uint8_t *src, uint8_t header[PACK_BLOCK]) {
+#if defined(SPROTO_AVX2)
+	pack_header_avx2(src, header);
+#else
+#if defined(SPROTO_SIMD_DISPATCH)
+	if (simd_avx2) {
+		pack_header_avx2(src, header);
+		return;
+	}
+#endif
+#if defined(SPROTO_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	int m0 = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)src), zero));
+	int m1 = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), zero));
+	header[0] = m0 & 0xff;
+	header[1] = (m0 >> 8) & 0xff;
+	header[2] = m1 & 0xff;
+	header[3] = (m1 >> 8) & 0xff;
+#else
+	int i;
+	for (i=0;i<PACK_BLOCK;i++) {
+		header[i] = pack_mask(src + i * 8);
+	}
+#endif
+#endif
+}
+
+static inline int
+popcount8(int x) {
+	x = x - ((x >> 1) & 0x55);
+	x = (x & 0x33) + ((x >> 2) & 0x33);
+	return (x + (x >> 4)) & 0x0f;
+}
+
+#if defined(SPROTO_SSSE3) || defined(SPROTO_SIMD_DISPATCH)
+
+// the positions of nonzero bytes in the low and the high half of a word, by the bits of the half
+static const uint32_t pack_shuffle[2][16] = {
+	{ 0x00000000, 0x00000000, 0x00000001, 0x00000100, 0x00000002, 0x00000200, 0x00000201, 0x00020100,
+	  0x00000003, 0x00000300, 0x00000301, 0x00030100, 0x00000302, 0x00030200, 0x00030201, 0x03020100 },
+	{ 0x00000000, 0x00000004, 0x00000005, 0x00000504, 0x00000006, 0x00000604, 0x00000605, 0x00060504,
+	  0x00000007, 0x00000704, 0x00000705, 0x00070504, 0x00000706, 0x00070604, 0x00070605, 0x07060504 },
+};
+
+static inline SIMD_TARGET("ssse3") void
+pack_compact_ssse3(const uint8_t *src, int header, uint8_t *des) {
+	uint64_t index = pack_shuffle[0][header & 0xf] | (uint64_t)pack_shuffle[1][header >> 4] << (8 * popcount8(header & 0xf));
+	__m128i x = _mm_loadl_epi64((const __m128i *)src);
+	_mm_storel_epi64((__m128i *)des, _mm_shuffle_epi8(x, _mm_loadl_epi64((const __m128i *)&index)));
+}
+
+#endif
+
+// move the nonzero bytes of a word to the front of des, 8 bytes are written
+static inline void
+pack_compact(const uint8_t *src, int header, uint8_t *des) {
+#if defined(SPROTO_SSSE3)
+	pack_compact_ssse3(src, header, des);
+#else
+	int i;
+#if defined(SPROTO_SIMD_DISPATCH)
+	if (simd_ssse3) {
+		pack_compact_ssse3(src, header, des);
+		return;
+	}
+#endif
+	for (i=0;i<8;i++) {
+		*des = src[i];
+		des += (header >> i) & 1;
+	}
+#endif
+}
+
+/*
+	pack a word not in a 0xff run, header is the bits of nonzero bytes of it, sz is the room of buffer.
+	It takes popcount8(header) + 1 bytes.
+*/
+static inline void
+pack_seg(const uint8_t *src, int header, uint8_t * buffer, int sz) {
+	if (sz > 8) {
+		buffer[0] = header;
+		pack_compact(src, header, buffer + 1);
+	} else if (sz > 0) {
+		int i;
+		buffer[0] = header;
+		for (i=0;i<8;i++) {
+			if (((header >> i) & 1) && sz > 1) {
+				*++buffer = src[i];
+				--sz;
+			}
+		}
+	}
+}
+
+static inline void
+write_ff(const uint8_t * src, uint8_t * des, int n) {
+	int i;
+	int align8_n = (n+7)&(~7);
+
+	des[0] = 0xff;
+	des[1] = align8_n/8 - 1;
+	// src may overlap des when packing in place
+	memmove(des+2, src, n);
+	for(i=0; i< align8_n-n; i++){
+		des[n+2+i] = 0;
+	}
+}
+
+/*
+** pack the message with the 0 packing algorithm.
+** srcv ԭ, srcsz:ԭݴСbufferv:Ŀ껺棬 bufsz:С
+*/
+int
+sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+	uint8_t tmp[8];
+	uint8_t header[PACK_BLOCK];
+	int block = 0;
+	int i;
+	const uint8_t * ff_srcstart = NULL;
+	uint8_t * ff_desstart = NULL;
+	int ff_n = 0;
+	int size = 0;
+	const uint8_t * src = (const uint8_t *)srcv;
+	uint8_t * buffer = (uint8_t *)bufferv;
+	for (i=0;i<srcsz;i+=8) {
+		int n, h, notzero;
+		int k = (i / 8) % PACK_BLOCK;
+		int padding = i+8 - srcsz;
+		if (k == 0) {
+			// scan the headers of a block at once
+			block = i + PACK_BLOCK * 8 <= srcsz;
+			if (block)
+				pack_header(src, header);
+		}
 		if (padding > 0) {
 			int j;
 			memcpy(tmp, src, 8-padding);
@@ -1449,95 +4994,1040 @@ sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
 			}
 			src = tmp;
 		}
-		n = pack_seg(src, buffer, bufsz, ff_n);
-		bufsz -= n;
-		if (n == 10) {
-			// first FF
-			ff_srcstart = src;
-			ff_desstart = buffer;
-			ff_n = 1;
-		} else if (n==8 && ff_n>0) {
-			++ff_n;
-			if (ff_n == 256) {
-				if (bufsz >= 0) {
-					write_ff(ff_srcstart, ff_desstart, 256*8);
+		h = block ? header[k] : pack_mask(src);
+		notzero = popcount8(h);
+		if (notzero == 8 || (notzero >= 6 && ff_n > 0)) {
+			// the word is in a 0xff run
+			if (ff_n == 0) {
+				// first FF
+				ff_srcstart = src;
+				ff_desstart = buffer;
+				n = 10;
+			} else {
+				n = 8;
+			}
+			bufsz -= n;
+			++ff_n;
+			if (ff_n == 256) {
+				if (bufsz >= 0) {
+					write_ff(ff_srcstart, ff_desstart, 256*8);
+				}
+				ff_n = 0;
+			}
+		} else {
+			// the run is written before the word, so the source of it is never overwritten in place
+			if (ff_n > 0) {
+				if (bufsz >= 0) {
+					write_ff(ff_srcstart, ff_desstart, ff_n*8);
+				}
+				ff_n = 0;
+			}
+			n = notzero + 1;
+			pack_seg(src, h, buffer, bufsz);
+			bufsz -= n;
+		}
+		src += 8;
+		buffer += n;
+		size += n;
+	}
+	if(bufsz >= 0){
+		if(ff_n == 1)
+			write_ff(ff_srcstart, ff_desstart, 8);
+		else if (ff_n > 1)
+			write_ff(ff_srcstart, ff_desstart, srcsz - (intptr_t)(ff_srcstart - (const uint8_t*)srcv));
+	}
+	return size;
+}
+
+// the gap before the message encoded in place, more than the worst-case overhead of packing
+#define PACK_INPLACE_GAP(sz) (((sz) + 2047) / 2048 * 2 + 4)
+
+/*
+** encode and pack the message in one buffer: it's encoded at the tail of buffer,
+** and then packed forward to the head in place. returns the packed size, or -1.
+*/
+int
+sproto_encode_packed(const struct sproto_type *st, void * buffer, int size, sproto_callback cb, void *ud) {
+	int gap = PACK_INPLACE_GAP(size);
+	uint8_t * data = (uint8_t *)buffer + gap;
+	int sz;
+	if (size <= gap)
+		return -1;
+	sz = sproto_encode_nested(st, data, size - gap, cb, ud);
+	if (sz < 0)
+		return -1;
+	sz = sproto_pack(data, sz, buffer, size);
+	if (sz > size)
+		return -1;
+	return sz;
+}
+
+#if defined(SPROTO_SSSE3) || defined(SPROTO_SIMD_DISPATCH)
+
+// the rank of each nonzero byte in a half word by the bits of the half, 0x80 for zero bytes
+static const uint32_t unpack_shuffle[16] = {
+	0x80808080, 0x80808000, 0x80800080, 0x80800100, 0x80008080, 0x80018000, 0x80010080, 0x80020100,
+	0x00808080, 0x01808000, 0x01800080, 0x02800100, 0x01008080, 0x02018000, 0x02010080, 0x03020100,
+};
+
+static inline SIMD_TARGET("ssse3") void
+unpack_expand_ssse3(const uint8_t *src, int header, uint8_t *des) {
+	uint32_t hi = unpack_shuffle[header >> 4] + popcount8(header & 0xf) * 0x01010101u;
+	uint64_t index = unpack_shuffle[header & 0xf] | (uint64_t)hi << 32;
+	__m128i x = _mm_loadl_epi64((const __m128i *)src);
+	_mm_storel_epi64((__m128i *)des, _mm_shuffle_epi8(x, _mm_loadl_epi64((const __m128i *)&index)));
+}
+
+#endif
+
+// expand the nonzero bytes of a word in src by header, 8 bytes of src are read
+static inline void
+unpack_expand(const uint8_t *src, int header, uint8_t *des) {
+#if defined(SPROTO_SSSE3)
+	unpack_expand_ssse3(src, header, des);
+#else
+	int i;
+#if defined(SPROTO_SIMD_DISPATCH)
+	if (simd_ssse3) {
+		unpack_expand_ssse3(src, header, des);
+		return;
+	}
+#endif
+	for (i=0;i<8;i++) {
+		int nz = (header >> i) & 1;
+		des[i] = *src & -nz;
+		src += nz;
+	}
+#endif
+}
+
+/*
+** unpack the message with the 0 packing algorithm, fails (-2) as soon as the size exceeds limit (> 0).
+*/
+int
+sproto_unpack_limit(const void * srcv, int srcsz, void * bufferv, int bufsz, int limit) {
+	const uint8_t * src = (const uint8_t *)srcv;
+	uint8_t * buffer = (uint8_t *)bufferv;
+	int size = 0;
+	while (srcsz > 0) {
+		uint8_t header = src[0];
+		if (limit > 0 && size > limit)
+			return -2;
+		if (header != 0xff && srcsz >= PACK_BLOCK * 9 && bufsz >= PACK_BLOCK * 8) {
+			// a block of words, the bounds are checked once
+			int i;
+			for (i=0;i<PACK_BLOCK;i++) {
+				int n;
+				header = src[0];
+				if (header == 0xff)
+					break;
+				n = popcount8(header) + 1;
+				unpack_expand(src + 1, header, buffer);
+				src += n;
+				srcsz -= n;
+				buffer += 8;
+				bufsz -= 8;
+				size += 8;
+			}
+			continue;
+		}
+		--srcsz;
+		++src;
+		if (header == 0xff) {
+			int n;
+			if (srcsz < 1) {
+				return -1;
+			}
+			n = (src[0] + 1) * 8;
+			if (srcsz < n + 1)
+				return -1;
+			srcsz -= n + 1;
+			++src;
+			if (bufsz >= n) {
+				memcpy(buffer, src, n);
+			}
+			bufsz -= n;
+			buffer += n;
+			src += n;
+			size += n;
+		} else {
+			int i;
+			for (i=0;i<8;i++) {
+				int nz = (header >> i) & 1;
+				if (nz) {
+					if (srcsz <= 0)
+						return -1;
+					if (bufsz > 0) {
+						*buffer = *src;
+						--bufsz;
+						++buffer;
+					}
+					++src;
+					--srcsz;
+				} else {
+					if (bufsz > 0) {
+						*buffer = 0;
+						--bufsz;
+						++buffer;
+					}
+				}
+				++size;
+			}
+		}
+	}
+	if (limit > 0 && size > limit)
+		return -2;
+	return size;
+}
+
+int
+sproto_unpack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+	return sproto_unpack_limit(srcv, srcsz, bufferv, bufsz, 0);
+}
+
+// scan the headers and the run lengths only
+int
+sproto_unpacked_size(const void * srcv, int srcsz) {
+	const uint8_t * src = (const uint8_t *)srcv;
+	int size = 0;
+	while (srcsz > 0) {
+		int n;
+		if (src[0] == 0xff) {
+			if (srcsz < 2)
+				return -1;
+			n = (src[1] + 1) * 8;
+			size += n;
+			n += 2;
+		} else {
+			n = popcount8(src[0]) + 1;
+			size += 8;
+		}
+		if (srcsz < n)
+			return -1;
+		src += n;
+		srcsz -= n;
+	}
+	return size;
+}
+
+/*
+** a word is packed into 8 bytes at most, except the 0xff runs have 2 bytes header.
+** a run ended by a word of 5 nonzero bytes at most doesn't exceed 8 bytes per word with that word,
+** so only the runs of 256 words and the last one cost 2 bytes more.
+*/
+int
+sproto_pack_bound(int srcsz) {
+	int words = (srcsz + 7) / 8;
+	return words * 8 + (words + 255) / 256 * 2;
+}
+
+// the buffer size sproto_encode_packed never fails with, sz is the result of sproto_encode_size
+int
+sproto_encode_packed_bound(int sz) {
+	int bound = sproto_pack_bound(sz);
+	int size = bound;
+	// the gap grows with the buffer, it converges in a few steps
+	while (size - PACK_INPLACE_GAP(size) < bound)
+		size = bound + PACK_INPLACE_GAP(size);
+	return size;
+}
+
+// the packed words are expanded on demand, as far as the decoder needs
+struct unpack_window {
+	const uint8_t * src;
+	int srcsz;	// packed bytes left
+	uint8_t * buffer;
+	int bufsz;
+	int size;	// bytes unpacked
+	int limit;
+};
+
+// unpack the words until need bytes are ready, returns -1 for the invalid stream, -2 over the limit, or -3 if the buffer is too small
+static int
+unpack_window_fill(struct unpack_window *w, int need) {
+	if (w->limit > 0 && need > w->limit)
+		return -2;
+	while (w->size < need) {
+		uint8_t header;
+		int n;
+		if (w->srcsz <= 0)
+			return -1;
+		header = w->src[0];
+		if (header == 0xff) {
+			if (w->srcsz < 2)
+				return -1;
+			n = (w->src[1] + 1) * 8;
+			if (w->srcsz < n + 2)
+				return -1;
+			if (w->bufsz - w->size < n)
+				return -3;
+			memcpy(w->buffer + w->size, w->src + 2, n);
+			w->src += n + 2;
+			w->srcsz -= n + 2;
+			w->size += n;
+			continue;
+		}
+		n = popcount8(header) + 1;
+		if (w->srcsz < n)
+			return -1;
+		if (w->bufsz - w->size < 8)
+			return -3;
+		if (w->srcsz >= 9) {
+			unpack_expand(w->src + 1, header, w->buffer + w->size);
+		} else {
+			int i;
+			const uint8_t * p = w->src + 1;
+			for (i=0;i<8;i++) {
+				w->buffer[w->size + i] = ((header >> i) & 1) ? *p++ : 0;
+			}
+		}
+		w->src += n;
+		w->srcsz -= n;
+		w->size += 8;
+	}
+	return 0;
+}
+
+/*
+** unpack the message at offset till the end of it (or the last field selected by the projection),
+** returns the unpacked size of the message
+*/
+static int
+unpack_window_message(struct unpack_window *w, int offset, const struct sproto_projection *proj) {
+	int fn, i, tag, r;
+	int size;
+	if ((r = unpack_window_fill(w, offset + SIZEOF_HEADER)))
+		return r;
+	fn = toword(w->buffer + offset);
+	size = SIZEOF_HEADER + fn * SIZEOF_FIELD;
+	if ((r = unpack_window_fill(w, offset + size)))
+		return r;
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		int value = toword(w->buffer + offset + SIZEOF_HEADER + i * SIZEOF_FIELD);
+		uint32_t sz;
+		++tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		if (proj && (proj->n == 0 || tag > proj->tag[proj->n - 1]))
+			break;
+		if (value != 0)
+			continue;
+		if ((r = unpack_window_fill(w, offset + size + SIZEOF_LENGTH)))
+			return r;
+		sz = todword(w->buffer + offset + size);
+		// a word unpacks to 8 bytes at most, reject the bad length before growing the buffer for it
+		if (sz > (uint32_t)(INT_MAX - offset - size - SIZEOF_LENGTH)
+			|| (long long)sz > (long long)w->srcsz * 8 + w->size - offset - size - SIZEOF_LENGTH)
+			return -1;
+		size += sz + SIZEOF_LENGTH;
+	}
+	if ((r = unpack_window_fill(w, offset + size)))
+		return r;
+	return size;
+}
+
+// adaptive framing
+
+// the zero bytes are counted, a word costs 1 byte header
+int
+sproto_pack_gain(const void * srcv, int srcsz) {
+	const uint8_t * src = (const uint8_t *)srcv;
+	uint8_t header[PACK_BLOCK];
+	int nonzero = 0;
+	int i, j;
+	for (i=0;i + PACK_BLOCK * 8 <= srcsz;i+=PACK_BLOCK * 8) {
+		pack_header(src + i, header);
+		for (j=0;j<PACK_BLOCK;j++) {
+			nonzero += popcount8(header[j]);
+		}
+	}
+	for (;i<srcsz;i++) {
+		nonzero += src[i] != 0;
+	}
+	return srcsz - nonzero - (srcsz + 7) / 8;
+}
+
+int
+sproto_frame(const void * src, int srcsz, void * bufferv, int bufsz, int threshold) {
+	uint8_t * buffer = (uint8_t *)bufferv;
+	if ((long long)sproto_pack_gain(src, srcsz) * 100 >= (long long)threshold * srcsz) {
+		int sz = sproto_pack(src, srcsz, buffer + 1, bufsz - 1);
+		// the estimate may be wrong for the 0xff runs, so the raw one is used if it's not smaller
+		if (sz < srcsz) {
+			if (sz < bufsz)
+				buffer[0] = SPROTO_FRAME_PACKED;
+			return sz + 1;
+		}
+	}
+	if (srcsz < bufsz) {
+		buffer[0] = SPROTO_FRAME_RAW;
+		memcpy(buffer + 1, src, srcsz);
+	}
+	return srcsz + 1;
+}
+
+int
+sproto_unframe(const void * srcv, int srcsz, void * buffer, int bufsz) {
+	const uint8_t * src = (const uint8_t *)srcv;
+	if (srcsz < 1)
+		return -1;
+	switch (src[0]) {
+	case SPROTO_FRAME_PACKED:
+		return sproto_unpack(src + 1, srcsz - 1, buffer, bufsz);
+	case SPROTO_FRAME_RAW:
+		if (srcsz - 1 <= bufsz)
+			memcpy(buffer, src + 1, srcsz - 1);
+		return srcsz - 1;
+	}
+	return -1;
+}
+
+int
+sproto_unpack_prefix(const void * src, int srcsz, void * buffer, int bufsz, int size, int *used) {
+	struct unpack_window w;
+	int r;
+	w.src = (const uint8_t *)src;
+	w.srcsz = srcsz;
+	w.buffer = (uint8_t *)buffer;
+	w.bufsz = bufsz;
+	w.size = 0;
+	w.limit = 0;
+	if (size < 0) {
+		r = unpack_window_message(&w, 0, NULL);
+	} else {
+		r = unpack_window_fill(&w, size);
+		if (r == -1 && w.srcsz == 0)
+			r = 0;	// the stream is shorter than size
+	}
+	if (r < 0)
+		return r;
+	*used = srcsz - w.srcsz;
+	return w.size;
+}
+
+int
+sproto_decode_packed(const struct sproto_type *st, const void * packed, int packsz, int offset, void * buffer, int bufsz, const struct sproto_projection *proj, const struct sproto_visitor *vis, void *ud, const struct sproto_limit *limit) {
+	struct unpack_window w;
+	int sz;
+	w.src = (const uint8_t *)packed;
+	w.srcsz = packsz;
+	w.buffer = (uint8_t *)buffer;
+	w.bufsz = bufsz;
+	w.size = 0;
+	w.limit = limit ? limit->unpacked : 0;
+	if (offset < 0 || offset > INT_MAX - SIZEOF_HEADER)
+		return -1;
+	sz = unpack_window_message(&w, offset, proj);
+	if (sz < 0)
+		return sz;
+	return sproto_decode_limit(st, w.buffer + offset, sz, proj, vis, ud, limit);
+}
+
+// streaming pack and unpack, the words and the 0xff runs are carried across the segments
+
+#define PACKER_BUFFERSIZE 4096
+
+struct sproto_packer {
+	uint8_t word[8];	// the partial word
+	int wn;
+	int ff_n;	// words in the pending 0xff run
+	int ff_pos;	// the header of the pending run in out
+	int out_pos;	// bytes of out emitted
+	int out_n;
+	uint8_t out[PACKER_BUFFERSIZE];
+};
+
+struct sproto_packer *
+sproto_packer_create(void) {
+	struct sproto_packer * p = (struct sproto_packer *)malloc(sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	sproto_packer_reset(p);
+	return p;
+}
+
+void
+sproto_packer_release(struct sproto_packer *p) {
+	free(p);
+}
+
+void
+sproto_packer_reset(struct sproto_packer *p) {
+	p->wn = 0;
+	p->ff_n = 0;
+	p->ff_pos = 0;
+	p->out_pos = 0;
+	p->out_n = 0;
+}
+
+// emit the packed bytes before the pending run
+static int
+packer_emit(struct sproto_packer *p, uint8_t * buffer, int bufsz) {
+	int n = (p->ff_n > 0 ? p->ff_pos : p->out_n) - p->out_pos;
+	if (n > bufsz)
+		n = bufsz;
+	memcpy(buffer, p->out + p->out_pos, n);
+	p->out_pos += n;
+	if (p->out_pos == p->out_n) {
+		p->out_pos = 0;
+		p->out_n = 0;
+	}
+	return n;
+}
+
+// make room for the next word, returns 0 if out is full
+static int
+packer_reserve(struct sproto_packer *p) {
+	if (p->out_n + 10 <= PACKER_BUFFERSIZE)
+		return 1;
+	if (p->out_pos == 0)
+		return 0;
+	memmove(p->out, p->out + p->out_pos, p->out_n - p->out_pos);
+	p->out_n -= p->out_pos;
+	p->ff_pos -= p->out_pos;
+	p->out_pos = 0;
+	return p->out_n + 10 <= PACKER_BUFFERSIZE;
+}
+
+static void
+packer_endrun(struct sproto_packer *p) {
+	p->out[p->ff_pos] = 0xff;
+	p->out[p->ff_pos + 1] = p->ff_n - 1;
+	p->ff_n = 0;
+}
+
+// the same as a word in sproto_pack
+static void
+packer_word(struct sproto_packer *p, const uint8_t * src) {
+	int h = pack_mask(src);
+	int notzero = popcount8(h);
+	if (notzero == 8 || (notzero >= 6 && p->ff_n > 0)) {
+		if (p->ff_n == 0) {
+			p->ff_pos = p->out_n;
+			p->out_n += 2;
+		}
+		memcpy(p->out + p->out_n, src, 8);
+		p->out_n += 8;
+		if (++p->ff_n == 256)
+			packer_endrun(p);
+	} else {
+		if (p->ff_n > 0)
+			packer_endrun(p);
+		pack_seg(src, h, p->out + p->out_n, PACKER_BUFFERSIZE - p->out_n);
+		p->out_n += notzero + 1;
+	}
+}
+
+int
+sproto_packer_feed(struct sproto_packer *p, const void * srcv, int srcsz, void * bufferv, int bufsz, int *outsz) {
+	const uint8_t * src = (const uint8_t *)srcv;
+	uint8_t * buffer = (uint8_t *)bufferv;
+	int used = 0;
+	int out = 0;
+	while (used < srcsz) {
+		if (!packer_reserve(p)) {
+			out += packer_emit(p, buffer + out, bufsz - out);
+			if (!packer_reserve(p))
+				break;
+		}
+		if (p->wn == 0 && srcsz - used >= 8) {
+			if (p->ff_n == 0 && p->out_pos == p->out_n && bufsz - out >= 10) {
+				// nothing is pending, pack the word into buffer directly unless it begins a run
+				int h = pack_mask(src + used);
+				if (h != 0xff) {
+					pack_seg(src + used, h, buffer + out, bufsz - out);
+					out += popcount8(h) + 1;
+					used += 8;
+					continue;
 				}
-				ff_n = 0;
 			}
+			packer_word(p, src + used);
+			used += 8;
 		} else {
-			if (ff_n > 0) {
-				if (bufsz >= 0) {
-					write_ff(ff_srcstart, ff_desstart, ff_n*8);
-				}
-				ff_n = 0;
+			int n = 8 - p->wn;
+			if (n > srcsz - used)
+				n = srcsz - used;
+			memcpy(p->word + p->wn, src + used, n);
+			p->wn += n;
+			used += n;
+			if (p->wn == 8) {
+				packer_word(p, p->word);
+				p->wn = 0;
 			}
 		}
-		src += 8;
-		buffer += n;
-		size += n;
 	}
-	if(bufsz >= 0){
-		if(ff_n == 1)
-			write_ff(ff_srcstart, ff_desstart, 8);
-		else if (ff_n > 1)
-			write_ff(ff_srcstart, ff_desstart, srcsz - (intptr_t)(ff_srcstart - (const uint8_t*)srcv));
+	*outsz = out + packer_emit(p, buffer + out, bufsz - out);
+	return used;
+}
+
+int
+sproto_packer_finish(struct sproto_packer *p, void * bufferv, int bufsz, int *outsz) {
+	uint8_t * buffer = (uint8_t *)bufferv;
+	int out = 0;
+	if (p->wn > 0) {
+		if (!packer_reserve(p)) {
+			out = packer_emit(p, buffer, bufsz);
+			if (!packer_reserve(p)) {
+				*outsz = out;
+				return 1;
+			}
+		}
+		memset(p->word + p->wn, 0, 8 - p->wn);
+		packer_word(p, p->word);
+		p->wn = 0;
 	}
-	return size;
+	if (p->ff_n > 0)
+		packer_endrun(p);
+	out += packer_emit(p, buffer + out, bufsz - out);
+	*outsz = out;
+	if (p->out_pos < p->out_n)
+		return 1;
+	sproto_packer_reset(p);
+	return 0;
+}
+
+struct sproto_unpacker {
+	int header;	// the header of the word being read, -1 before a word
+	int need;	// bytes of the word (or the 0xff run) to read, -1 for the length of the run
+	int got;
+	uint8_t data[8];	// the nonzero bytes of the word
+	uint8_t out[8];	// the unpacked word not emitted
+	int out_pos;
+	int out_n;
+};
+
+struct sproto_unpacker *
+sproto_unpacker_create(void) {
+	struct sproto_unpacker * u = (struct sproto_unpacker *)malloc(sizeof(*u));
+	if (u == NULL)
+		return NULL;
+	sproto_unpacker_reset(u);
+	return u;
+}
+
+void
+sproto_unpacker_release(struct sproto_unpacker *u) {
+	free(u);
+}
+
+void
+sproto_unpacker_reset(struct sproto_unpacker *u) {
+	u->header = -1;
+	u->need = 0;
+	u->got = 0;
+	u->out_pos = 0;
+	u->out_n = 0;
 }
 
-/*
-** unpack the message with the 0 packing algorithm.
-*/
 int
-sproto_unpack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+sproto_unpacker_feed(struct sproto_unpacker *u, const void * srcv, int srcsz, void * bufferv, int bufsz, int *outsz) {
 	const uint8_t * src = (const uint8_t *)srcv;
 	uint8_t * buffer = (uint8_t *)bufferv;
-	int size = 0;
-	while (srcsz > 0) {
-		uint8_t header = src[0];
-		--srcsz;
-		++src;
-		if (header == 0xff) {
-			int n;
-			if (srcsz < 0) {
-				return -1;
+	int used = 0;
+	int out = 0;
+	for (;;) {
+		int n;
+		if (u->out_pos < u->out_n) {
+			n = u->out_n - u->out_pos;
+			if (n > bufsz - out)
+				n = bufsz - out;
+			memcpy(buffer + out, u->out + u->out_pos, n);
+			out += n;
+			u->out_pos += n;
+			if (u->out_pos < u->out_n)
+				break;
+		}
+		if (used == srcsz)
+			break;
+		if (u->header < 0) {
+			int header = src[used];
+			if (header != 0xff && srcsz - used >= 9 && bufsz - out >= 8) {
+				// a whole word in this segment
+				unpack_expand(src + used + 1, header, buffer + out);
+				used += popcount8(header) + 1;
+				out += 8;
+				continue;
 			}
-			n = (src[0] + 1) * 8;
-			if (srcsz < n + 1)
-				return -1;
-			srcsz -= n + 1;
-			++src;
-			if (bufsz >= n) {
-				memcpy(buffer, src, n);
+			++used;
+			u->header = header;
+			u->need = header == 0xff ? -1 : popcount8(header);
+			u->got = 0;
+		} else if (u->header == 0xff) {
+			if (u->need < 0) {
+				u->need = (src[used++] + 1) * 8;
+				continue;
 			}
-			bufsz -= n;
-			buffer += n;
-			src += n;
-			size += n;
+			// the run is copied through
+			n = u->need;
+			if (n > srcsz - used)
+				n = srcsz - used;
+			if (n > bufsz - out)
+				n = bufsz - out;
+			if (n == 0)
+				break;
+			memcpy(buffer + out, src + used, n);
+			used += n;
+			out += n;
+			u->need -= n;
+			if (u->need == 0)
+				u->header = -1;
+			continue;
 		} else {
+			n = u->need;
+			if (n > srcsz - used)
+				n = srcsz - used;
+			memcpy(u->data + u->got, src + used, n);
+			used += n;
+			u->got += n;
+			u->need -= n;
+		}
+		if (u->header != 0xff && u->need == 0) {
+			// the word is complete
+			const uint8_t * p = u->data;
 			int i;
 			for (i=0;i<8;i++) {
-				int nz = (header >> i) & 1;
-				if (nz) {
-					if (srcsz < 0)
-						return -1;
-					if (bufsz > 0) {
-						*buffer = *src;
-						--bufsz;
-						++buffer;
-					}
-					++src;
-					--srcsz;
-				} else {
-					if (bufsz > 0) {
-						*buffer = 0;
-						--bufsz;
-						++buffer;
-					}
-				}
-				++size;
+				u->out[i] = ((u->header >> i) & 1) ? *p++ : 0;
 			}
+			u->out_pos = 0;
+			u->out_n = 8;
+			u->header = -1;
 		}
 	}
-	return size;
+	*outsz = out;
+	return used;
+}
+
+int
+sproto_unpacker_finish(struct sproto_unpacker *u) {
+	if (u->header >= 0)
+		return -1;
+	if (u->out_pos < u->out_n)
+		return 1;
+	sproto_unpacker_reset(u);
+	return 0;
+}
+
+// dynamic message
+// A message is decoded into a tree in an arena, reset the arena to free all of them at once.
+
+#define ARENA_CHUNKSIZE 4096
+
+struct arena_chunk {
+	struct arena_chunk * next;
+	int size;
+};
+
+struct sproto_arena {
+	struct arena_chunk * header;
+	struct arena_chunk * current;
+	int used;
+	int chunksize;
+};
+
+struct sproto_arena *
+sproto_arena_create(int chunksize) {
+	struct sproto_arena * a = (struct sproto_arena *)malloc(sizeof(*a));
+	if (a == NULL)
+		return NULL;
+	a->header = NULL;
+	a->current = NULL;
+	a->used = 0;
+	a->chunksize = chunksize > 0 ? chunksize : ARENA_CHUNKSIZE;
+	return a;
+}
+
+void
+sproto_arena_release(struct sproto_arena *a) {
+	struct arena_chunk * c;
+	if (a == NULL)
+		return;
+	c = a->header;
+	while (c) {
+		struct arena_chunk * n = c->next;
+		free(c);
+		c = n;
+	}
+	free(a);
+}
+
+// the chunks are kept for the next message
+void
+sproto_arena_reset(struct sproto_arena *a) {
+	a->current = a->header;
+	a->used = 0;
+}
+
+void *
+sproto_arena_alloc(struct sproto_arena *a, int sz) {
+	struct arena_chunk * c = a->current;
+	struct arena_chunk * n;
+	if (sz <= 0 || sz > INT_MAX - 7)
+		return NULL;
+	// align by 8
+	sz = (sz + 7) & ~7;
+	if (c && sz <= c->size - a->used) {
+		void * ret = (char *)(c+1) + a->used;
+		a->used += sz;
+		return ret;
+	}
+	// try the chunks kept by reset
+	while (c && c->next) {
+		c = c->next;
+		if (sz <= c->size) {
+			a->current = c;
+			a->used = sz;
+			return c+1;
+		}
+	}
+	n = (struct arena_chunk *)malloc(sizeof(*n) + (sz > a->chunksize ? sz : a->chunksize));
+	if (n == NULL)
+		return NULL;
+	n->next = NULL;
+	n->size = sz > a->chunksize ? sz : a->chunksize;
+	if (c) {
+		c->next = n;
+	} else {
+		a->header = n;
+	}
+	a->current = n;
+	a->used = sz;
+	return n+1;
+}
+
+struct message_node {
+	struct sproto_message m;
+	struct message_node * parent;
+};
+
+struct message_ud {
+	struct sproto_arena * arena;
+	struct message_node * current;
+};
+
+static struct message_node *
+message_node(struct sproto_arena *a, const struct sproto_type *st, struct message_node *parent) {
+	struct message_node * node = (struct message_node *)sproto_arena_alloc(a, sizeof(*node));
+	if (node == NULL)
+		return NULL;
+	node->m.st = st;
+	node->m.n = 0;
+	node->m.f = NULL;
+	node->parent = parent;
+	if (st->n > 0) {
+		// a tag is decoded once at most
+		node->m.f = (struct sproto_message_field *)sproto_arena_alloc(a, sizeof(struct sproto_message_field) * st->n);
+		if (node->m.f == NULL)
+			return NULL;
+	}
+	return node;
+}
+
+static struct sproto_message_field *
+message_field(struct sproto_message *m, const struct sproto_arg *args) {
+	struct sproto_message_field * f = &m->f[m->n++];
+	f->tag = args->tagid;
+	f->name = args->tagname;
+	f->type = args->type;
+	f->extra = args->extra;
+	f->n = 1;
+	f->v = &f->value;
+	return f;
+}
+
+// a new field, or the element of the array (the last field)
+static struct sproto_value *
+message_value(const struct sproto_arg *args) {
+	struct message_ud * u = (struct message_ud *)args->ud;
+	struct sproto_message * m = &u->current->m;
+	if (args->index > 0)
+		return &m->f[m->n-1].v[args->index-1];
+	return message_field(m, args)->v;
+}
+
+static int
+message_integer(const struct sproto_arg *args, long long v) {
+	message_value(args)->u.i = v;
+	return 0;
+}
+
+static int
+message_boolean(const struct sproto_arg *args, int v) {
+	message_value(args)->u.i = v;
+	return 0;
+}
+
+static int
+message_string(const struct sproto_arg *args, const void *str, int sz) {
+	struct sproto_value * v = message_value(args);
+	v->u.str.p = (const char *)str;
+	v->u.str.sz = sz;
+	return 0;
+}
+
+static int
+message_struct_begin(const struct sproto_arg *args) {
+	struct message_ud * u = (struct message_ud *)args->ud;
+	struct sproto_value * v = message_value(args);
+	struct message_node * node = message_node(u->arena, args->subtype, u->current);
+	if (node == NULL)
+		return SPROTO_CB_ERROR;
+	v->u.msg = &node->m;
+	u->current = node;
+	return 0;
+}
+
+static int
+message_struct_end(const struct sproto_arg *args) {
+	struct message_ud * u = (struct message_ud *)args->ud;
+	u->current = u->current->parent;
+	return 0;
+}
+
+static int
+message_array_begin(const struct sproto_arg *args, int n) {
+	struct message_ud * u = (struct message_ud *)args->ud;
+	struct sproto_message_field * f = message_field(&u->current->m, args);
+	f->type |= SPROTO_TARRAY;
+	f->n = n;
+	f->v = NULL;
+	if (n > 0) {
+		if (n > INT_MAX / (int)sizeof(struct sproto_value))
+			return SPROTO_CB_ERROR;
+		f->v = (struct sproto_value *)sproto_arena_alloc(u->arena, sizeof(struct sproto_value) * n);
+		if (f->v == NULL)
+			return SPROTO_CB_ERROR;
+	}
+	return 0;
+}
+
+static const struct sproto_visitor message_visitor = {
+	message_integer,
+	message_boolean,
+	message_string,
+	message_struct_begin,
+	message_struct_end,
+	message_array_begin,
+	NULL,
+};
+
+int
+sproto_message_decode(struct sproto_arena *a, const struct sproto_type *st, const void * data, int size, struct sproto_message **msg) {
+	struct message_ud u;
+	u.arena = a;
+	u.current = message_node(a, st, NULL);
+	if (u.current == NULL)
+		return -1;
+	*msg = &u.current->m;
+	return sproto_decode_visitor(st, data, size, NULL, &message_visitor, &u);
+}
+
+const struct sproto_message_field *
+sproto_message_find(const struct sproto_message *m, int tag) {
+	int begin = 0, end = m->n;
+	while (begin < end) {
+		int mid = (begin+end)/2;
+		int t = m->f[mid].tag;
+		if (t == tag) {
+			return &m->f[mid];
+		}
+		if (tag > t) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return NULL;
+}
+
+const struct sproto_message_field *
+sproto_message_lookup(const struct sproto_message *m, const char * name) {
+	int i;
+	for (i=0;i<m->st->n;i++) {
+		struct field *f = &m->st->f[i];
+		if (strcmp(f->name, name) == 0) {
+			return sproto_message_find(m, f->tag);
+		}
+	}
+	return NULL;
+}
+
+struct message_encode_ud {
+	void * stack;	// const struct sproto_message *
+	void * local;
+	int cap;
+	int depth;
+};
+
+static int
+message_encode(const struct sproto_arg *args) {
+	struct message_encode_ud * u = (struct message_encode_ud *)args->ud;
+	const struct sproto_message * m = ((const struct sproto_message **)u->stack)[u->depth];
+	const struct sproto_message_field * f;
+	const struct sproto_value * v;
+	if (args->nest < 0) {
+		--u->depth;
+		return 0;
+	}
+	f = sproto_message_find(m, args->tagid);
+	if (f == NULL)
+		return args->index > 0 ? SPROTO_CB_NOARRAY : SPROTO_CB_NIL;
+	if (args->index > 0) {
+		if (!(f->type & SPROTO_TARRAY))
+			return SPROTO_CB_ERROR;
+		if (args->index > f->n)
+			return SPROTO_CB_NIL;
+		v = &f->v[args->index-1];
+	} else {
+		v = f->v;
+	}
+	switch (args->type) {
+	case SPROTO_TINTEGER: {
+		int64_t vh = v->u.i >> 31;
+		if (vh == 0 || vh == -1) {
+			*(uint32_t *)args->value = (uint32_t)v->u.i;
+			return 4;
+		}
+		*(uint64_t *)args->value = (uint64_t)v->u.i;
+		return 8;
+	}
+	case SPROTO_TBOOLEAN:
+		*(int *)args->value = v->u.i != 0;
+		return 4;
+	case SPROTO_TSTRING:
+		if (v->u.str.sz > args->length)
+			return SPROTO_CB_ERROR;
+		memcpy(args->value, v->u.str.p, v->u.str.sz);
+		return v->u.str.sz;
+	case SPROTO_TSTRUCT: {
+		const struct sproto_message ** top;
+		if (args->nest == 0 || v->u.msg == NULL || v->u.msg->st != args->subtype)
+			return SPROTO_CB_ERROR;
+		top = (const struct sproto_message **)nest_push(&u->stack, u->local, &u->cap, u->depth + 1, sizeof(*top));
+		if (top == NULL)
+			return SPROTO_CB_ERROR;
+		*top = v->u.msg;
+		++u->depth;
+		return SPROTO_CB_NEST;
+	}
+	}
+	return SPROTO_CB_ERROR;
+}
+
+int
+sproto_message_encode(const struct sproto_message *m, void * buffer, int size) {
+	const struct sproto_message * local[NEST_LOCALFRAME];
+	struct message_encode_ud u;
+	int r;
+	local[0] = m;
+	u.stack = local;
+	u.local = local;
+	u.cap = NEST_LOCALFRAME;
+	u.depth = 0;
+	r = sproto_encode_nested(m->st, buffer, size, message_encode, &u);
+	if (u.stack != u.local)
+		free(u.stack);
+	return r;
 }
@@ -5,6 +5,7 @@
 
 struct sproto;
 struct sproto_type;
+struct sproto_writer;
 
 #define SPROTO_REQUEST 0
 #define SPROTO_RESPONSE 1
@@ -22,6 +23,8 @@ struct sproto_type;
 #define SPROTO_CB_ERROR -1
 #define SPROTO_CB_NIL -2
 #define SPROTO_CB_NOARRAY -3
+#define SPROTO_CB_BULK -4	// return it for the first element of an integer or boolean array to read or write the array in bulk
+#define SPROTO_CB_NEST -5	// return it for a struct (sproto_arg.nest == 1) to let the nested engine walk into it
 
 struct sproto * sproto_create(const void * proto, size_t sz);
 void sproto_release(struct sproto *);
@@ -36,6 +39,27 @@ struct sproto_type * sproto_type(const struct sproto *, const char * type_name);
 
 int sproto_pack(const void * src, int srcsz, void * buffer, int bufsz);
 int sproto_unpack(const void * src, int srcsz, void * buffer, int bufsz);
+// returns -2 if the unpacked size exceeds limit (> 0)
+int sproto_unpack_limit(const void * src, int srcsz, void * buffer, int bufsz, int limit);
+// the size sproto_unpack returns, without unpacking; -1 if the stream is truncated
+int sproto_unpacked_size(const void * src, int srcsz);
+// the max size sproto_pack returns for srcsz bytes
+int sproto_pack_bound(int srcsz);
+// adaptive framing: a flag byte, and then the packed message or the raw one
+#define SPROTO_FRAME_PACKED 0
+#define SPROTO_FRAME_RAW 1
+
+// the bytes sproto_pack may save (an estimate by the zero bytes), it's negative for the dense message
+int sproto_pack_gain(const void * src, int srcsz);
+// the message is packed if the gain is threshold percent of srcsz at least, returns the frame size (more than bufsz if it's too small)
+int sproto_frame(const void * src, int srcsz, void * buffer, int bufsz, int threshold);
+// returns the size of message in the frame as sproto_unpack, or -1 for the bad frame
+int sproto_unframe(const void * src, int srcsz, void * buffer, int bufsz);
+
+// unpack the words till size bytes are unpacked (or the end of stream), size < 0 means the first message (a struct) in the stream.
+// returns the bytes unpacked, which may be more than needed for the whole words, and sets *used to the packed bytes read.
+// returns -1 if the stream is truncated, or -3 if buffer is too small
+int sproto_unpack_prefix(const void * src, int srcsz, void * buffer, int bufsz, int size, int *used);
 
 struct sproto_arg {
 	void *ud;
@@ -48,11 +72,227 @@ struct sproto_arg {
 	int index;	// array base 1
 	int mainindex;	// for map
 	int extra; // SPROTO_TINTEGER: decimal ; SPROTO_TSTRING 0:utf8 string 1:binary
+	struct sproto_writer *writer;	// not NULL in sproto_encode_writer
+	int bulk;	// not 0 in a bulk array call : the whole count when decoding, -1 when encoding
+	const struct sproto_projection *projection;	// decoding a struct field : the projection of it, NULL means all
+	int nest;	// the nested engine : 1 begins a struct, -1 ends it
 };
 typedef int (*sproto_callback)(const struct sproto_arg *args);
 
 int sproto_decode(const struct sproto_type *, const void * data, int size, sproto_callback cb, void *ud);
 int sproto_encode(const struct sproto_type *, void * buffer, int size, sproto_callback cb, void *ud);
+// the buffer size sproto_encode needs, cb is called with value == NULL for string and struct to query the size
+int sproto_encode_size(const struct sproto_type *, sproto_callback cb, void *ud);
+// returns the bytes of the message, or -1 if sproto_decode would fail on it
+int sproto_verify(const struct sproto_type *, const void * data, int size);
+// sproto_decode without bounds checks, only for the messages passed sproto_verify
+int sproto_decode_trusted(const struct sproto_type *, const void * data, int size, sproto_callback cb, void *ud);
+
+// the selected tags of a type, sub[i] selects the fields of struct tag[i] (NULL means all)
+struct sproto_projection {
+	int n;
+	const int * tag;	// ascending
+	const struct sproto_projection * const * sub;	// NULL if none of them is projected
+};
+
+// walk into the structs with the frames on the heap instead of the callback recursion
+int sproto_encode_nested(const struct sproto_type *, void * buffer, int size, sproto_callback cb, void *ud);
+int sproto_encode_size_nested(const struct sproto_type *, sproto_callback cb, void *ud);
+// sproto_encode_nested and sproto_pack in one buffer, returns the packed size or -1
+int sproto_encode_packed(const struct sproto_type *, void * buffer, int size, sproto_callback cb, void *ud);
+int sproto_encode_packed_bound(int sz);
+
+// typed visitor for decoding, args describes the field (args->index is base 1 for an element of array).
+// every entry returns 0 to continue, or SPROTO_CB_ERROR to abort. on_struct_begin can return
+// SPROTO_CB_NIL to skip the struct. A NULL entry ignores the values, or skips the structs.
+struct sproto_visitor {
+	int (*on_integer)(const struct sproto_arg *args, long long v);
+	int (*on_boolean)(const struct sproto_arg *args, int v);
+	int (*on_string)(const struct sproto_arg *args, const void *str, int sz);
+	int (*on_struct_begin)(const struct sproto_arg *args);
+	int (*on_struct_end)(const struct sproto_arg *args);
+	int (*on_array_begin)(const struct sproto_arg *args, int n);
+	int (*on_array_end)(const struct sproto_arg *args);
+};
+
+int sproto_decode_visitor(const struct sproto_type *, const void * data, int size, const struct sproto_projection *, const struct sproto_visitor *, void *ud);
+
+// limits for the untrusted input, 0 means no limit
+struct sproto_limit {
+	int unpacked;	// bytes unpacked by sproto_unpack_limit and sproto_decode_packed
+	int elements;	// elements of all the arrays in a message
+	int depth;		// nesting level of structs
+	int string;		// bytes of all the strings in a message
+	int tables;		// tables created by a decode, for the lua binding
+	int staged;		// bytes of a unit (header, string or struct) split across segments, copied by sproto_decoder
+};
+
+// sproto_decode_visitor with limits, returns -2 as soon as a limit is exceeded
+int sproto_decode_limit(const struct sproto_type *, const void * data, int size, const struct sproto_projection *, const struct sproto_visitor *, void *ud, const struct sproto_limit *);
+
+// decode the message at the unpacked offset of a packed stream, the words are unpacked into buffer as far as the message needs.
+// returns -3 if buffer is too small
+int sproto_decode_packed(const struct sproto_type *, const void * packed, int packsz, int offset, void * buffer, int bufsz, const struct sproto_projection *, const struct sproto_visitor *, void *ud, const struct sproto_limit *);
+
+// streaming pack and unpack, the stream is fed in segments of any size.
+// feed returns the bytes of src used, and sets *outsz to the bytes written into buffer; feed the rest of src again when buffer is full.
+struct sproto_packer;
+struct sproto_unpacker;
+
+struct sproto_packer * sproto_packer_create(void);
+void sproto_packer_release(struct sproto_packer *);
+void sproto_packer_reset(struct sproto_packer *);
+int sproto_packer_feed(struct sproto_packer *, const void * src, int srcsz, void * buffer, int bufsz, int *outsz);
+// end of the message, returns 0 when all the output is written (the packer is reset), or 1 to call it again with more buffer
+int sproto_packer_finish(struct sproto_packer *, void * buffer, int bufsz, int *outsz);
+
+struct sproto_unpacker * sproto_unpacker_create(void);
+void sproto_unpacker_release(struct sproto_unpacker *);
+void sproto_unpacker_reset(struct sproto_unpacker *);
+int sproto_unpacker_feed(struct sproto_unpacker *, const void * src, int srcsz, void * buffer, int bufsz, int *outsz);
+// end of the stream, returns 0 if it ends at a word (the unpacker is reset), -1 if it's truncated,
+// or 1 if some output is not written yet (feed an empty segment to get it)
+int sproto_unpacker_finish(struct sproto_unpacker *);
+
+// streaming decode, the message is fed in segments and the callbacks are invoked as fields are complete
+struct sproto_decoder;
+
+struct sproto_decoder * sproto_decoder_create(const struct sproto_type *, sproto_callback cb, void *ud);
+void sproto_decoder_release(struct sproto_decoder *);
+// drop the partial message, and begin a new one
+void sproto_decoder_reset(struct sproto_decoder *);
+// returns 0 if more data is needed, -1 on error, -2 over the staged limit,
+// or the bytes used in this segment when the message is done (the rest begins the next message)
+int sproto_decoder_feed(struct sproto_decoder *, const void * data, int size);
+// only limit->staged is used, NULL for no limit
+void sproto_decoder_limit(struct sproto_decoder *, const struct sproto_limit *);
+
+// decode the selected fields only, and stop after the last one.
+// returns the bytes read, which may be less than the message then
+int sproto_decode_projection(const struct sproto_type *, const void * data, int size, const struct sproto_projection *, sproto_callback cb, void *ud);
+
+// chunked output, chunksize <= 0 means default
+struct sproto_writer * sproto_writer_create(int chunksize);
+void sproto_writer_release(struct sproto_writer *);
+void sproto_writer_reset(struct sproto_writer *);
+int sproto_writer_size(const struct sproto_writer *);
+int sproto_writer_write(struct sproto_writer *, const void * data, int sz);
+// the same layout as struct iovec in posix
+struct sproto_iovec {
+	const void * base;
+	size_t len;
+};
+// fill the segments of output into iov (at most n), returns the number of all the segments even if it's more than n
+// (as snprintf does), so call it with n == 0 to count them
+int sproto_writer_iov(const struct sproto_writer *, struct sproto_iovec * iov, int n);
+// sproto_writer_write references the data not less than threshold instead of copying it, 0 (default) means never
+void sproto_writer_reference(struct sproto_writer *, int threshold);
+int sproto_writer_copy(const struct sproto_writer *, void * buffer, int size);
+// append the encoded message to the writer, returns the size of the message
+int sproto_encode_writer(const struct sproto_type *, struct sproto_writer *, sproto_callback cb, void *ud);
+
+// bind a sproto type to a C struct layout, encode and decode without callback
+struct sproto_binding;
+
+// string member, points into the input buffer after decode (not zero terminated), NULL str means nil
+struct sproto_string {
+	const char * str;
+	int sz;
+};
+
+struct sproto_struct_desc;
+
+struct sproto_field_desc {
+	const char * name;	// field name in the sproto type
+	int offset;	// offset of the member, the member of an array is the element pointer (NULL means nil)
+	int size;	// size of integer or boolean (member or array element) : 1, 2, 4, 8
+	int count;	// offset of the int element count, for array
+	const struct sproto_struct_desc * sub;	// for struct and struct array, the struct is embedded in the parent
+};
+
+struct sproto_struct_desc {
+	int size;	// sizeof the C struct
+	int n;
+	const struct sproto_field_desc * f;
+};
+
+struct sproto_binding * sproto_bind(const struct sproto_type *, const struct sproto_struct_desc *);
+void sproto_binding_release(struct sproto_binding *);
+int sproto_encode_struct(const struct sproto_binding *, const void * obj, void * buffer, int size);
+// obj is cleared first, arrays are allocated from mem
+int sproto_decode_struct(const struct sproto_binding *, const void * data, int size, void * obj, void * mem, int memsz);
+
+// random access to an encoded message without decoding or copying it
+struct sproto_view;
+
+struct sproto_view_field {
+	int tag;
+	int type;	// SPROTO_TINTEGER, SPROTO_TBOOLEAN, SPROTO_TSTRING or SPROTO_TSTRUCT
+	int array;
+	int extra;
+	struct sproto_type * subtype;
+};
+
+// the buffer size a view of the type needs
+int sproto_view_size(const struct sproto_type *);
+// index the header of message in buffer, returns NULL if the message is malformed
+struct sproto_view * sproto_view_init(void * buffer, int bufsz, const struct sproto_type *, const void * data, int sz);
+int sproto_view_lookup(const struct sproto_type *, const char * name, struct sproto_view_field *);
+// index is base 1 for an element of array, or 0 for a field.
+// returns 0, SPROTO_CB_NIL if it's not exist, or SPROTO_CB_ERROR
+int sproto_view_count(const struct sproto_view *, int tag);	// returns the count of elements
+int sproto_view_integer(const struct sproto_view *, int tag, int index, long long *v);
+int sproto_view_boolean(const struct sproto_view *, int tag, int index, int *v);
+// string, or the encoded message of struct
+int sproto_view_string(const struct sproto_view *, int tag, int index, const void ** str, int *sz);
+struct sproto_view * sproto_view_struct(const struct sproto_view *, int tag, int index, void * buffer, int bufsz);
+
+// the memory of tag -> field lookup built for types with sparse tags, in bytes
+size_t sproto_lookup_memory(const struct sproto *);
+
+// dynamic message, decoded into a tree in an arena. strings are slices of the decoded data.
+struct sproto_arena;
+
+struct sproto_arena * sproto_arena_create(int chunksize);	// 0 for default
+void sproto_arena_release(struct sproto_arena *);
+void sproto_arena_reset(struct sproto_arena *);	// free all the messages in it
+void * sproto_arena_alloc(struct sproto_arena *, int sz);	// NULL if sz <= 0
+
+struct sproto_message;
+
+struct sproto_value {
+	union {
+		long long i;	// integer (decimal is not scaled) or boolean
+		struct {
+			const char * p;
+			int sz;
+		} str;
+		struct sproto_message * msg;
+	} u;
+};
+
+struct sproto_message_field {
+	const char * name;
+	int tag;
+	int type;	// with SPROTO_TARRAY for array
+	int extra;
+	int n;		// count of elements, 1 for a field not array
+	struct sproto_value * v;	// elements are contiguous
+	struct sproto_value value;	// the storage of v if it's not an array
+};
+
+struct sproto_message {
+	const struct sproto_type * st;
+	int n;
+	struct sproto_message_field * f;	// fields present, ascending by tag
+};
+
+// returns the bytes decoded, or -1
+int sproto_message_decode(struct sproto_arena *, const struct sproto_type *, const void * data, int size, struct sproto_message **msg);
+int sproto_message_encode(const struct sproto_message *, void * buffer, int size);
+// NULL if the field is not present
+const struct sproto_message_field * sproto_message_find(const struct sproto_message *, int tag);
+const struct sproto_message_field * sproto_message_lookup(const struct sproto_message *, const char * name);
 
 // for debug use
 void sproto_dump(struct sproto *);
@@ -70,6 +70,14 @@ local function querytype(self, typename)
 	return v
 end
 
+-- decode and pdecode also take a projection made by sproto:projection as the typename
+local function querydecode(self, typename)
+	if type(typename) == "userdata" then
+		return typename
+	end
+	return querytype(self, typename)
+end
+
 -- ǷڴԶ
 function sproto:exist_type(typename)
 	local v = self.__tcache[typename]
@@ -86,22 +94,48 @@ function sproto:encode(typename, tbl)
 	return core.encode(st, tbl)
 end
 
+-- returns the buffer size sproto:encode needs for the lua table, without encoding it
+function sproto:encode_size(typename, tbl)
+	local st = querytype(self, typename)
+	return core.encodesize(st, tbl)
+end
+
 -- decodes a binary string generated by sproto.encode with typename.
 -- If blob is a lightuserdata (C ptr), sz (integer) is needed.
 -- sproto:decode(typename, blob [,sz])
 function sproto:decode(typename, ...)
-	local st = querytype(self, typename)
+	local st = querydecode(self, typename)
 	return core.decode(st, ...)
 end
 
+-- returns the size of the binary string, or nil if sproto:decode would fail on it
+function sproto:verify(typename, ...)
+	local st = querytype(self, typename)
+	return core.verify(st, ...)
+end
+
+-- selects the fields to decode : { "name", name = { fields of the struct } },
+-- use the returned projection as the typename of sproto:decode and sproto:pdecode
+function sproto:projection(typename, fields)
+	local st = querytype(self, typename)
+	return core.projection(st, self, fields)
+end
+
+-- returns a view of the binary string, reading the fields on demand without decoding.
+-- The view refers to the blob and the sproto object, so a C ptr must outlive it.
+function sproto:view(typename, ...)
+	local st = querytype(self, typename)
+	return core.view(st, self, ...)
+end
+
 function sproto:pencode(typename, tbl)
 	local st = querytype(self, typename)
-	return core.pack(core.encode(st, tbl))
+	return core.pencode(st, tbl)
 end
 
 function sproto:pdecode(typename, ...)
-	local st = querytype(self, typename)
-	return core.decode(st, core.unpack(...))
+	local st = querydecode(self, typename)
+	return core.pdecode(st, nil, 0, ...)
 end
 
 
@@ -177,8 +211,13 @@ function sproto:response_decode(protoname, ...)
 	end
 end
 
+sproto.blob = core.blob	-- marks a string encoded by sproto.encode, to splice it into a struct field or element.
 sproto.pack = core.pack	-- packs a string encoded by sproto.encode to reduce the size.
 sproto.unpack = core.unpack	-- unpacks the string packed by sproto.pack.
+sproto.frame = core.frame	-- frames a string encoded by sproto.encode: sproto.frame(threshold, msg) packs it if it saves threshold percent at least.
+sproto.unframe = core.unframe	-- unpacks the frame made by sproto.frame, packed or raw.
+sproto.unpackprefix = core.unpackprefix	-- unpacks the first bytes (or the first message) only, and returns the packed bytes read.
+sproto.limit = core.limit	-- sets the limits of decode and unpack for the untrusted input, see README.
 
 -- Create a table with default values of typename. Type can be nil , "REQUEST", or "RESPONSE".
 function sproto:default(typename, type)
@@ -202,8 +241,17 @@ end
 
 local header_tmp = {}
 
+-- packs the message of the protocol, or frames it if host:framing is set
+local function host_pack(self, name, msg)
+	local threshold = self.__framing
+	if threshold then
+		return core.frame(self.__thresholds[name] or threshold, msg)
+	end
+	return core.pack(msg)
+end
+
 -- һӦ
-local function gen_response(self, response, session)
+local function gen_response(self, response, session, name)
 	-- õһӦøúӦṹõӦ
 	return function(args, ud)
 		header_tmp.type = nil -- typeΪnilʾresponse
@@ -212,9 +260,9 @@ local function gen_response(self, response, session)
 		local header = core.encode(self.__package, header_tmp)
 		if response then
 			local content = core.encode(response, args)
-			return core.pack(header .. content)
+			return host_pack(self, name, header .. content)
 		else
-			return core.pack(header)
+			return host_pack(self, name, header)
 		end
 	end
 end
@@ -223,21 +271,20 @@ end
 -- retuen "REQUEST", ,
 -- return "RESPONSE"
 function host:dispatch(...)
-	local bin = core.unpack(...)
+	local pdecode = self.__framing and core.fdecode or core.pdecode
 	header_tmp.type = nil
 	header_tmp.session = nil
 	header_tmp.ud = nil
-	local header, size = core.decode(self.__package, bin, header_tmp) -- Эͷ
-	local content = bin:sub(size + 1)	-- ȥͷʣ¾
+	local header, size = pdecode(self.__package, header_tmp, 0, ...) -- Эͷ
 	if header.type then	-- typetagtypeʾӦ
 		-- request
 		local proto = queryproto(self.__proto, header.type) -- Эheader.typeõtypeЭ
 		local result
 		if proto.request then
-			result = core.decode(proto.request, content) -- Э
+			result = pdecode(proto.request, nil, size, ...) -- Эݣͷ֮ʼ
 		end
 		if header_tmp.session then	-- ҪӦ
-			return "REQUEST", proto.name, result, gen_response(self, proto.response, header_tmp.session), header.ud
+			return "REQUEST", proto.name, result, gen_response(self, proto.response, header_tmp.session, proto.name), header.ud
 		else
 			return "REQUEST", proto.name, result, nil, header.ud
 		end
@@ -250,7 +297,7 @@ function host:dispatch(...)
 		if response == true then
 			return "RESPONSE", session, nil, header.ud
 		else
-			local result = core.decode(response, content)
+			local result = pdecode(response, nil, size, ...)
 			return "RESPONSE", session, result, header.ud
 		end
 	end
@@ -277,11 +324,19 @@ function host:attach(sp)
 
 		if proto.request then
 			local content = core.encode(proto.request, args) -- Э
-			return core.pack(header ..  content) -- Э
+			return host_pack(self, name, header ..  content) -- Э
 		else
-			return core.pack(header)
+			return host_pack(self, name, header)
 		end
 	end
 end
 
+-- switches to the adaptive framing, the peer should switch too.
+-- a message is packed if it saves threshold percent (default 0) at least, or it's sent raw with a flag byte.
+-- thresholds (optional) is a table of protoname = percent, which overrides threshold for the protocols.
+function host:framing(threshold, thresholds)
+	self.__framing = threshold or 0
+	self.__thresholds = thresholds or {}
+end
+
 return sproto
@@ -61,9 +61,154 @@ local obj = {
 }
 
 local code = sp:encode("foobar", obj)
+assert(sp:encode_size("foobar", obj) >= #code)
 obj = sp:decode("foobar", code)
 print_r(obj)
 
+assert(sp:verify("foobar", code) == #code)
+assert(sp:verify("foobar", code:sub(1, -2)) == nil)
+
+-- decode the selected fields only
+local proj = sp:projection("foobar", { "a", "f", h = { "e" } })
+local part = sp:decode(proj, code)
+assert(part.a == "hello" and part.b == nil and #part.f == 6 and part.d == nil)
+assert(#part.h == 4 and part.h[1].b == nil and part.h[4].e[1] == "test")
+-- the sub projections live as long as the projection
+local subproj = sp:projection("foobar", { h = { "b", "e" } })
+collectgarbage()
+part = sp:decode(subproj, code)
+assert(part.a == nil and part.h[1].b == 100 and part.h[4].e[1] == "test")
+assert(not pcall(sp.encode, sp, proj, obj) and not pcall(sp.view, sp, proj, code))
+
+-- a view reads the fields in place
+local view = sp:view("foobar", code)
+assert(view.a == "hello" and view.b == 1000000 and view.c == true)
+assert(#view.d == 4 and view.d[2].a == "two" and view.d[4].d == obj.d.decimal.d and view.d[5] == nil)
+assert(#view.f == 6 and view.f[1] == -3 and view.g[2] == false and view.i[2] == obj.i[2])
+assert(view.h[4].e[1] == "test" and view.h[2].b == nil and view.j == obj.j)
+-- the view keeps the sproto object alive
+local own = sproto.parse [[ .t { a 0 : string  b 1 : *t } ]]
+local ownview = own:view("t", own:encode("t", { a = "x", b = { { a = "y" } } }))
+local ownarray = ownview.b
+local ownmsg = own:encode("t", { a = "x", b = { { a = "y" } } })
+local ownproj = own:projection("t", { b = { "a" } })
+own = nil
+collectgarbage()
+assert(ownview.a == "x" and ownview.b[1].a == "y" and ownarray[1].a == "y")
+-- and so does the projection
+assert(sp:decode(ownproj, ownmsg).b[1].a == "y")
+
+-- large integer and boolean arrays are encoded and decoded in bulk
+local big = { f = {}, g = {}, i = {} }
+for i = 1, 1000 do
+	big.f[i] = i * 0x10000000 - 0x7fffffff
+	big.g[i] = i % 3 == 0
+	big.i[i] = (i - 500) / 100
+end
+local bigobj = sp:decode("foobar", sp:encode("foobar", big))
+assert(#bigobj.f == 1000 and #bigobj.g == 1000)
+for i = 1, 1000 do
+	assert(bigobj.f[i] == big.f[i] and bigobj.g[i] == big.g[i] and bigobj.i[i] == big.i[i])
+end
+
+-- deep structs are encoded and decoded without recursion
+local deep = {}
+local node = deep
+for i = 1, 200 do
+	node.b = i
+	node.h = { {} }
+	node = node.h[1]
+end
+local deepobj = sp:decode("foobar", sp:encode("foobar", deep))
+assert(sp:encode_size("foobar", deep) >= #sp:encode("foobar", deep))
+node.a = string.rep("x", 100000)	-- too large for the buffer, and too deep for the writer
+assert(sp:decode("foobar", sp:encode("foobar", deep)).h[1].h[1].b == 3)
+assert(sp:pencode("foobar", deep) == sproto.pack(sp:encode("foobar", deep)))
+node.a = nil
+for i = 1, 200 do
+	assert(deepobj.b == i)
+	deepobj = deepobj.h[1]
+end
+node.b = "x"	-- the error of a deep field is raised after the engine returns
+assert(select(2, pcall(sp.encode, sp, "foobar", deep)):find(".b[0] is not an integer", 1, true))
+assert(not pcall(sp.encode_size, sp, "foobar", deep))
+assert(not pcall(sp.pencode, sp, "foobar", deep))
+node.b = nil
+local cyclic = { b = 1 }
+cyclic.h = { cyclic }
+assert(select(2, pcall(sp.encode, sp, "foobar", cyclic)):find "too deep")
+assert(not pcall(sp.pencode, sp, "foobar", cyclic))
+node.d = { { b = true } }	-- a map element without its main index, deep in the message
+local nokey = sp:encode("foobar", deep)
+node.d = nil
+assert(select(2, pcall(sp.decode, sp, "foobar", nokey)):find "Can't find main index")
+assert(select(2, pcall(sp.pdecode, sp, "foobar", sproto.pack(nokey))):find "Can't find main index")
+assert(sp:verify("foobar", nokey) == nil)
+
+-- the untrusted input is rejected by the limits
+local deepmsg = sp:encode("foobar", deep)
+assert(sp:verify("foobar", deepmsg) == #deepmsg)
+sproto.limit { depth = 100 }
+assert(not pcall(sp.decode, sp, "foobar", deepmsg))
+sproto.limit { elements = 999 }
+assert(not pcall(sp.decode, sp, "foobar", sp:encode("foobar", big)))
+sproto.limit { tables = 10 }
+assert(not pcall(sp.decode, sp, "foobar", deepmsg))
+sproto.limit { unpacked = 1000 }
+assert(not pcall(sproto.unpack, sproto.pack(deepmsg)))
+sproto.limit {}
+assert(sp:decode("foobar", sproto.unpack(sproto.pack(deepmsg))).b == 1)
+
+-- a pre-encoded struct is spliced as it is
+local blob = {
+	d = { sproto.blob(sp:encode("foobar.nest", { a = "one", c = 1 })) },
+	h = { sproto.blob(sp:encode("foobar", { b = 1 })), { b = 2 } },
+}
+assert(sp:encode("foobar", blob) == sp:encode("foobar", { d = { { a = "one", c = 1 } }, h = { { b = 1 }, { b = 2 } } }))
+assert(sp:encode_size("foobar", blob) >= #sp:encode("foobar", blob))
+
+-- pencode encodes and packs in one buffer
+assert(sp:pencode("foobar", obj) == sproto.pack(sp:encode("foobar", obj)))
+assert(sp:pencode("foobar", big) == sproto.pack(sp:encode("foobar", big)))
+assert(sp:pencode("foobar", deep) == sproto.pack(deepmsg))
+
+-- pdecode decodes from the packed string
+local pobj, psize = sp:pdecode("foobar", sproto.pack(code))
+assert(psize == #code and pobj.a == "hello" and pobj.h[4].e[1] == "test")
+assert(sp:pdecode(proj, sproto.pack(code)).h[1].b == nil)
+assert(sp:pdecode("foobar", sp:pencode("foobar", deep)).b == 1)
+assert(not pcall(sp.pdecode, sp, "foobar", sproto.pack(code):sub(1, -4)))
+
+-- unpack the first message only
+local first, used = sproto.unpackprefix(nil, sproto.pack(code .. code))
+local rest = (code .. code):sub(#first + 1)
+assert(#first <= #code * 2 and first:sub(1, #code) == code)
+-- unpack pads the rest to 8 bytes words
+assert(sproto.unpack(sproto.pack(code .. code):sub(used + 1)):sub(1, #rest) == rest)
+assert(#sproto.unpackprefix(4, sproto.pack(code)) >= 4)
+
+-- a frame is packed or raw by the threshold
+assert(sproto.unframe(sproto.frame(101, code)) == code)
+assert(sp:decode("foobar", sproto.unframe(sproto.frame(0, deepmsg))).b == 1)
+assert(sproto.frame(0, deepmsg):byte(1) == 0 and #sproto.frame(0, deepmsg) == #sproto.pack(deepmsg) + 1)
+
+-- the fields of a type with a wide tag range are found by the hash lookup
+local sparse = sproto.parse [[
+.sparse {
+	a 0 : integer
+	b 3 : string
+	c 1000 : *integer
+	d 20000 : sparse
+	e 30000 : boolean
+}
+]]
+local sobj = { a = 1, b = "three", c = { 1, 1000, 100000 }, d = { b = "inner", e = true }, e = false }
+local sdec = sparse:decode("sparse", sparse:encode("sparse", sobj))
+assert(sdec.a == 1 and sdec.b == "three" and sdec.c[3] == 100000 and sdec.e == false)
+assert(sdec.d.b == "inner" and sdec.d.e == true and sdec.d.a == nil)
+sdec = sparse:decode(sparse:projection("sparse", { "c", d = { "e" } }), sparse:encode("sparse", sobj))
+assert(sdec.a == nil and sdec.b == nil and sdec.c[2] == 1000 and sdec.d.e == true and sdec.d.b == nil)
+
 -- core.dumpproto only for debug use
 local core = require "sproto.core"
 core.dumpproto(sp.__cobj)
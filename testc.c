@@ -0,0 +1,625 @@
+/*
+	tests of the C api, build and run them by : make testc
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include "sproto.h"
+
+/*
+	the bundle of this schema, made by sprotoparser.parse :
+
+	.node {
+		b 0 : integer
+		h 1 : *node
+	}
+
+	.foobar {
+		.nest {
+			a 1 : string
+			b 3 : boolean
+			c 5 : integer
+		}
+		a 0 : string
+		b 1 : integer
+		c 2 : boolean
+		d 3 : *nest(a)
+		e 4 : *string
+		f 5 : *integer
+		g 6 : *boolean
+		h 7 : *foobar
+		i 8 : *integer(2)
+		j 9 : binary
+		k 10 : nest
+	}
+ */
+static const uint8_t schema[] = {
+	0x01, 0x00, 0x00, 0x00, 0x8b, 0x01, 0x00, 0x00, 0xf3, 0x00, 0x00, 0x00,
+	0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x66, 0x6f,
+	0x6f, 0x62, 0x61, 0x72, 0xdf, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x00, 0x00, 0x06, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x61, 0x0f, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x02,
+	0x00, 0x01, 0x00, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x62, 0x0f, 0x00,
+	0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x04, 0x00, 0x01, 0x00, 0x06, 0x00,
+	0x01, 0x00, 0x00, 0x00, 0x63, 0x13, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00,
+	0x00, 0x01, 0x00, 0x04, 0x00, 0x08, 0x00, 0x04, 0x00, 0x04, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x64, 0x11, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+	0x06, 0x00, 0x01, 0x00, 0x0a, 0x00, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00,
+	0x65, 0x11, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01,
+	0x00, 0x0c, 0x00, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x66, 0x11, 0x00,
+	0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x04, 0x00, 0x01, 0x00, 0x0e, 0x00,
+	0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x67, 0x11, 0x00, 0x00, 0x00, 0x05,
+	0x00, 0x00, 0x00, 0x01, 0x00, 0x02, 0x00, 0x10, 0x00, 0x04, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x68, 0x11, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+	0x02, 0x00, 0x06, 0x00, 0x12, 0x00, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00,
+	0x69, 0x0f, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x06, 0x00, 0x04,
+	0x00, 0x14, 0x00, 0x01, 0x00, 0x00, 0x00, 0x6a, 0x0f, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x16, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x6b, 0x52, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x0b, 0x00, 0x00, 0x00, 0x66, 0x6f, 0x6f, 0x62, 0x61, 0x72, 0x2e,
+	0x6e, 0x65, 0x73, 0x74, 0x39, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x00, 0x00, 0x06, 0x00, 0x01, 0x00, 0x04, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x61, 0x0f, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x04,
+	0x00, 0x01, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00, 0x62, 0x0f, 0x00,
+	0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0x00, 0x0c, 0x00,
+	0x01, 0x00, 0x00, 0x00, 0x63, 0x3a, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x6e, 0x6f, 0x64, 0x65, 0x28,
+	0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x02,
+	0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x00, 0x00, 0x00, 0x62, 0x11, 0x00,
+	0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x01, 0x00, 0x06, 0x00, 0x04, 0x00,
+	0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x68,
+};
+
+static int failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failed; } } while(0)
+
+// bind
+
+struct node {
+	int64_t b;
+	struct node * h;
+	int hn;
+};
+
+static const struct sproto_field_desc node_f[2];
+static const struct sproto_struct_desc node_desc = { sizeof(struct node), 2, node_f };
+static const struct sproto_field_desc node_f[2] = {
+	{ "b", offsetof(struct node, b), 8, 0, NULL },
+	{ "h", offsetof(struct node, h), 0, offsetof(struct node, hn), &node_desc },
+};
+
+// sproto_decode_struct rejects the structs nested deeper than 256 levels
+static void
+test_bind_depth(struct sproto *sp) {
+	static struct node chain[300];
+	static uint8_t buffer[0x10000];
+	static uint8_t mem[0x10000];
+	struct sproto_binding * b = sproto_bind(sproto_type(sp, "node"), &node_desc);
+	struct node obj;
+	int i, sz;
+	CHECK(b != NULL);
+	for (i=0;i<300;i++) {
+		chain[i].b = i;
+		chain[i].h = i < 299 ? &chain[i+1] : NULL;
+		chain[i].hn = i < 299 ? 1 : 0;
+	}
+	// 256 levels
+	chain[255].h = NULL;
+	chain[255].hn = 0;
+	sz = sproto_encode_struct(b, chain, buffer, sizeof(buffer));
+	CHECK(sz > 0);
+	CHECK(sproto_decode_struct(b, buffer, sz, &obj, mem, sizeof(mem)) == sz);
+	CHECK(obj.hn == 1 && obj.h->b == 1);
+	// 300 levels
+	chain[255].h = &chain[256];
+	chain[255].hn = 1;
+	sz = sproto_encode_struct(b, chain, buffer, sizeof(buffer));
+	CHECK(sz > 0);
+	CHECK(sproto_decode_struct(b, buffer, sz, &obj, mem, sizeof(mem)) < 0);
+	sproto_binding_release(b);
+}
+
+// random messages, encoded by the binding
+
+struct nest {
+	struct sproto_string a;
+	int8_t b;
+	int64_t c;
+};
+
+struct foobar {
+	struct sproto_string a;
+	int64_t b;
+	int8_t c;
+	struct nest * d;
+	int dn;
+	struct sproto_string * e;
+	int en;
+	int64_t * f;
+	int fn;
+	int8_t * g;
+	int gn;
+	struct foobar * h;
+	int hn;
+	int64_t * i;
+	int in;
+	struct sproto_string j;
+	struct nest k;
+};
+
+static const struct sproto_field_desc nest_f[3] = {
+	{ "a", offsetof(struct nest, a), 0, 0, NULL },
+	{ "b", offsetof(struct nest, b), 1, 0, NULL },
+	{ "c", offsetof(struct nest, c), 8, 0, NULL },
+};
+static const struct sproto_struct_desc nest_desc = { sizeof(struct nest), 3, nest_f };
+
+static const struct sproto_field_desc foobar_f[11];
+static const struct sproto_struct_desc foobar_desc = { sizeof(struct foobar), 11, foobar_f };
+static const struct sproto_field_desc foobar_f[11] = {
+	{ "a", offsetof(struct foobar, a), 0, 0, NULL },
+	{ "b", offsetof(struct foobar, b), 8, 0, NULL },
+	{ "c", offsetof(struct foobar, c), 1, 0, NULL },
+	{ "d", offsetof(struct foobar, d), 0, offsetof(struct foobar, dn), &nest_desc },
+	{ "e", offsetof(struct foobar, e), 0, offsetof(struct foobar, en), NULL },
+	{ "f", offsetof(struct foobar, f), 8, offsetof(struct foobar, fn), NULL },
+	{ "g", offsetof(struct foobar, g), 1, offsetof(struct foobar, gn), NULL },
+	{ "h", offsetof(struct foobar, h), 0, offsetof(struct foobar, hn), &foobar_desc },
+	{ "i", offsetof(struct foobar, i), 8, offsetof(struct foobar, in), NULL },
+	{ "j", offsetof(struct foobar, j), 0, 0, NULL },
+	{ "k", offsetof(struct foobar, k), 0, 0, &nest_desc },
+};
+
+static uint32_t seed = 1;
+
+static int
+rnd(int n) {
+	seed = seed * 1103515245 + 12345;
+	return (int)((seed >> 16) % n);
+}
+
+static uint8_t pool[0x40000];
+static int pool_used;
+
+static void *
+palloc(int sz) {
+	void * p = pool + pool_used;
+	pool_used += (sz + 7) & ~7;
+	if (pool_used > (int)sizeof(pool)) {
+		printf("pool overflow\n");
+		exit(1);
+	}
+	return p;
+}
+
+static int64_t
+rint64(void) {
+	switch (rnd(4)) {
+	case 0:
+		return rnd(100);
+	case 1:
+		return -(int64_t)rnd(100000);
+	case 2:
+		return (int64_t)rnd(0x10000) << 40 | rnd(0x10000);
+	default:
+		return 0x7fff + rnd(0x10000);
+	}
+}
+
+static struct sproto_string
+rstr(int nil) {
+	struct sproto_string s;
+	char * p;
+	int i;
+	s.sz = rnd(20);
+	s.str = p = (char *)palloc(s.sz + 1);
+	for (i=0;i<s.sz;i++) {
+		p[i] = 'a' + rnd(26);
+	}
+	if (nil && rnd(4) == 0)
+		s.str = NULL;
+	return s;
+}
+
+static void
+rnest(struct nest *n) {
+	n->a = rstr(0);	// the key of map
+	n->b = rnd(2);
+	n->c = rint64();
+}
+
+// an array is nil (NULL) or has 0 to 5 elements
+static void *
+rarray(int *n, int esz) {
+	if (rnd(2)) {
+		*n = 0;
+		return NULL;
+	}
+	*n = rnd(6);
+	return palloc(*n * esz + 1);
+}
+
+static void
+rfoobar(struct foobar *o, int deep) {
+	int i;
+	memset(o, 0, sizeof(*o));
+	o->a = rstr(1);
+	o->b = rint64();
+	o->c = rnd(2);
+	o->d = (struct nest *)rarray(&o->dn, sizeof(struct nest));
+	for (i=0;i<o->dn;i++)
+		rnest(&o->d[i]);
+	o->e = (struct sproto_string *)rarray(&o->en, sizeof(struct sproto_string));
+	for (i=0;i<o->en;i++)
+		o->e[i] = rstr(0);
+	o->f = (int64_t *)rarray(&o->fn, sizeof(int64_t));
+	for (i=0;i<o->fn;i++)
+		o->f[i] = rint64();
+	o->g = (int8_t *)rarray(&o->gn, 1);
+	for (i=0;i<o->gn;i++)
+		o->g[i] = rnd(2);
+	if (deep < 3) {
+		o->h = (struct foobar *)rarray(&o->hn, sizeof(struct foobar));
+		if (o->hn > 3)
+			o->hn = 3;
+		for (i=0;i<o->hn;i++)
+			rfoobar(&o->h[i], deep + 1);
+	}
+	o->i = (int64_t *)rarray(&o->in, sizeof(int64_t));
+	for (i=0;i<o->in;i++)
+		o->i[i] = rint64();
+	o->j = rstr(1);
+	rnest(&o->k);
+}
+
+// encode a random foobar, returns the size
+static int
+random_message(const struct sproto_binding *b, void *buffer, int size) {
+	struct foobar obj;
+	int sz;
+	pool_used = 0;
+	rfoobar(&obj, 0);
+	sz = sproto_encode_struct(b, &obj, buffer, size);
+	if (sz < 0) {
+		printf("buffer is too small\n");
+		exit(1);
+	}
+	return sz;
+}
+
+// message
+
+// decode the random messages into the arena and encode them back
+static void
+test_message(struct sproto *sp) {
+	static uint8_t buffer[0x10000];
+	static uint8_t output[0x10000];
+	struct sproto_type * st = sproto_type(sp, "foobar");
+	struct sproto_binding * b = sproto_bind(st, &foobar_desc);
+	struct sproto_arena * arena = sproto_arena_create(0);
+	int i;
+	CHECK(b != NULL && arena != NULL);
+	CHECK(sproto_arena_alloc(arena, 0) == NULL);
+	CHECK(sproto_arena_alloc(arena, -8) == NULL);
+	CHECK(sproto_arena_alloc(arena, INT_MAX) == NULL);
+	for (i=0;i<200;i++) {
+		struct sproto_message * msg = NULL;
+		int sz = random_message(b, buffer, sizeof(buffer));
+		CHECK(sproto_message_decode(arena, st, buffer, sz, &msg) == sz);
+		CHECK(sproto_message_encode(msg, output, sizeof(output)) == sz);
+		CHECK(memcmp(buffer, output, sz) == 0);
+		sproto_arena_reset(arena);
+	}
+	sproto_arena_release(arena);
+	sproto_binding_release(b);
+}
+
+// streaming decode
+
+// the callbacks are recorded into a trace, the structs are decoded by sproto_decode
+struct trace {
+	uint8_t * buffer;
+	int size;
+	int n;
+};
+
+static void
+trace_write(struct trace *t, const void *p, int sz) {
+	if (t->n + sz > t->size) {
+		printf("trace overflow\n");
+		exit(1);
+	}
+	memcpy(t->buffer + t->n, p, sz);
+	t->n += sz;
+}
+
+static int
+trace_cb(const struct sproto_arg *args) {
+	struct trace * t = (struct trace *)args->ud;
+	int head[3];
+	head[0] = args->tagid;
+	head[1] = args->index;
+	head[2] = args->index < 0 ? 0 : args->length;
+	trace_write(t, head, sizeof(head));
+	if (args->index < 0)
+		return 0;
+	trace_write(t, args->value, args->length);
+	if (args->type == SPROTO_TSTRUCT) {
+		if (sproto_decode(args->subtype, args->value, args->length, trace_cb, t) < 0)
+			return SPROTO_CB_ERROR;
+	}
+	return 0;
+}
+
+// feed the message in the random segments of 1 to n bytes, returns the result of the last feed
+static int
+feed_segments(struct sproto_decoder *d, const uint8_t *data, int sz, int n) {
+	int offset = 0;
+	while (offset < sz) {
+		int seg = 1 + rnd(n);
+		int r;
+		if (seg > sz - offset)
+			seg = sz - offset;
+		r = sproto_decoder_feed(d, data + offset, seg);
+		if (r != 0)
+			return r < 0 ? r : offset + r;
+		offset += seg;
+	}
+	return 0;
+}
+
+// the decoder fed in segments calls back the same as sproto_decode
+static void
+test_decoder(struct sproto *sp) {
+	static uint8_t buffer[0x10000];
+	static uint8_t trace1[0x40000];
+	static uint8_t trace2[0x40000];
+	struct sproto_type * st = sproto_type(sp, "foobar");
+	struct sproto_binding * b = sproto_bind(st, &foobar_desc);
+	struct trace t1 = { trace1, sizeof(trace1), 0 };
+	struct trace t2 = { trace2, sizeof(trace2), 0 };
+	struct sproto_decoder * d = sproto_decoder_create(st, trace_cb, &t2);
+	struct sproto_limit limit;
+	struct foobar obj;
+	int i, sz;
+	CHECK(b != NULL && d != NULL);
+	for (i=0;i<200;i++) {
+		sz = random_message(b, buffer, sizeof(buffer));
+		t1.n = 0;
+		t2.n = 0;
+		CHECK(sproto_decode(st, buffer, sz, trace_cb, &t1) == sz);
+		CHECK(feed_segments(d, buffer, sz, i % 2 ? 8 : 64) == sz);
+		CHECK(t1.n == t2.n && memcmp(trace1, trace2, t1.n) == 0);
+	}
+	// a split string longer than the staged limit is rejected
+	memset(&obj, 0, sizeof(obj));
+	obj.a.str = "a string of 40 bytes, split by the feed";
+	obj.a.sz = 40;
+	sz = sproto_encode_struct(b, &obj, buffer, sizeof(buffer));
+	memset(&limit, 0, sizeof(limit));
+	limit.staged = 32;
+	sproto_decoder_limit(d, &limit);
+	CHECK(sproto_decoder_feed(d, buffer, sz) == sz);	// not split, nothing is staged
+	CHECK(sproto_decoder_feed(d, buffer, sz - 1) == 0);
+	CHECK(sproto_decoder_feed(d, buffer + sz - 1, 1) == 1);
+	CHECK(feed_segments(d, buffer, sz, 1) == -2);
+	sproto_decoder_reset(d);
+	sproto_decoder_limit(d, NULL);
+	CHECK(feed_segments(d, buffer, sz, 1) == sz);
+	sproto_decoder_release(d);
+	sproto_binding_release(b);
+}
+
+// streaming pack and unpack
+
+// the zero bytes, the runs of nonzero bytes (packed as 0xff) and the random bytes
+static int
+random_stream(uint8_t *data, int size) {
+	int n = 0;
+	while (n < size - 4096) {
+		int len, i;
+		switch (rnd(4)) {
+		case 0:
+			len = rnd(40);
+			memset(data + n, 0, len);
+			break;
+		case 1:
+			len = rnd(3000);
+			for (i=0;i<len;i++)
+				data[n+i] = 1 + rnd(255);
+			break;
+		default:
+			len = rnd(40);
+			for (i=0;i<len;i++)
+				data[n+i] = rnd(3) ? rnd(256) : 0;
+			break;
+		}
+		n += len;
+		if (rnd(8) == 0)
+			break;
+	}
+	return n;
+}
+
+// feed src in the random segments, into the random sizes of buffer. returns the output size, or -1
+static int
+stream_pack(struct sproto_packer *p, const uint8_t *src, int srcsz, uint8_t *out, int outsz) {
+	int offset = 0, n = 0, r, sz;
+	while (offset < srcsz) {
+		int seg = 1 + rnd(100);
+		if (seg > srcsz - offset)
+			seg = srcsz - offset;
+		while (seg > 0) {
+			int bufsz = 1 + rnd(64);
+			int used;
+			if (bufsz > outsz - n)
+				return -1;
+			used = sproto_packer_feed(p, src + offset, seg, out + n, bufsz, &sz);
+			if (used == 0 && sz == 0)
+				return -1;
+			offset += used;
+			seg -= used;
+			n += sz;
+		}
+	}
+	do {
+		int bufsz = 1 + rnd(64);
+		if (bufsz > outsz - n)
+			return -1;
+		r = sproto_packer_finish(p, out + n, bufsz, &sz);
+		n += sz;
+	} while (r);
+	return n;
+}
+
+static int
+stream_unpack(struct sproto_unpacker *u, const uint8_t *src, int srcsz, uint8_t *out, int outsz) {
+	int offset = 0, n = 0, r, sz;
+	while (offset < srcsz) {
+		int seg = 1 + rnd(100);
+		if (seg > srcsz - offset)
+			seg = srcsz - offset;
+		while (seg > 0) {
+			int bufsz = 1 + rnd(64);
+			int used;
+			if (bufsz > outsz - n)
+				return -1;
+			used = sproto_unpacker_feed(u, src + offset, seg, out + n, bufsz, &sz);
+			if (used < 0 || (used == 0 && sz == 0))
+				return -1;
+			offset += used;
+			seg -= used;
+			n += sz;
+		}
+	}
+	while ((r = sproto_unpacker_finish(u)) == 1) {
+		int bufsz = 1 + rnd(64);
+		if (bufsz > outsz - n)
+			return -1;
+		if (sproto_unpacker_feed(u, src, 0, out + n, bufsz, &sz) < 0)
+			return -1;
+		n += sz;
+	}
+	return r == 0 ? n : -1;
+}
+
+// the packer and the unpacker fed in segments give the same output as sproto_pack and sproto_unpack
+static void
+test_packer(void) {
+	static uint8_t src[0x8000];
+	static uint8_t packed[0x9000];
+	static uint8_t output[0x9000];
+	static uint8_t unpacked[0x9000];
+	struct sproto_packer * p = sproto_packer_create();
+	struct sproto_unpacker * u = sproto_unpacker_create();
+	int i;
+	CHECK(p != NULL && u != NULL);
+	for (i=0;i<300;i++) {
+		int srcsz = random_stream(src, sizeof(src));
+		int psz = sproto_pack(src, srcsz, packed, sizeof(packed));
+		int usz, sz;
+		CHECK(psz >= 0 && psz <= sproto_pack_bound(srcsz));
+		sz = stream_pack(p, src, srcsz, output, sizeof(output));
+		CHECK(sz == psz && memcmp(packed, output, psz) == 0);
+		usz = sproto_unpack(packed, psz, unpacked, sizeof(unpacked));
+		CHECK(usz >= srcsz && memcmp(unpacked, src, srcsz) == 0);
+		sz = stream_unpack(u, packed, psz, output, sizeof(output));
+		CHECK(sz == usz && memcmp(unpacked, output, usz) == 0);
+	}
+	sproto_unpacker_release(u);
+	sproto_packer_release(p);
+}
+
+// writer
+
+static int
+nest_cb(const struct sproto_arg *args) {
+	const struct nest * n = (const struct nest *)args->ud;
+	switch (args->tagid) {
+	case 1:
+		if (n->a.sz > args->length)	// append the long string to the writer
+			return sproto_writer_write(args->writer, n->a.str, n->a.sz) < 0 ? SPROTO_CB_ERROR : n->a.sz;
+		memcpy(args->value, n->a.str, n->a.sz);
+		return n->a.sz;
+	case 3:
+		*(int *)args->value = n->b;
+		return 4;
+	case 5:
+		*(int64_t *)args->value = n->c;
+		return 8;
+	}
+	return SPROTO_CB_NIL;
+}
+
+// the long string is referenced by a segment, and the segments join into the message
+static void
+test_writer(struct sproto *sp) {
+	static char str[300];
+	static uint8_t buffer[0x1000];
+	static uint8_t output[0x1000];
+	struct sproto_type * st = sproto_type(sp, "foobar.nest");
+	struct sproto_binding * b = sproto_bind(st, &nest_desc);
+	struct sproto_writer * w = sproto_writer_create(64);
+	struct sproto_iovec iov[16];
+	struct nest n;
+	int i, sz, count, ref = 0, offset = 0;
+	CHECK(b != NULL && w != NULL);
+	for (i=0;i<(int)sizeof(str);i++)
+		str[i] = 'a' + i % 26;
+	n.a.str = str;
+	n.a.sz = sizeof(str);
+	n.b = 1;
+	n.c = 0x123456789LL;
+	sz = sproto_encode_struct(b, &n, buffer, sizeof(buffer));
+	CHECK(sz > (int)sizeof(str));
+	sproto_writer_reference(w, 100);
+	CHECK(sproto_encode_writer(st, w, nest_cb, &n) == sz);
+	CHECK(sproto_writer_size(w) == sz);
+	CHECK(sproto_writer_copy(w, output, sizeof(output)) == sz && memcmp(buffer, output, sz) == 0);
+	count = sproto_writer_iov(w, NULL, 0);
+	CHECK(count >= 3 && count <= 16);
+	// the total count is returned even if n is less
+	CHECK(sproto_writer_iov(w, iov, 1) == count && iov[0].base != NULL);
+	CHECK(sproto_writer_iov(w, iov, 16) == count);
+	for (i=0;i<count && i<16;i++) {
+		if (iov[i].base == str && iov[i].len == sizeof(str))
+			++ref;
+		CHECK(offset + (int)iov[i].len <= sz && memcmp(buffer + offset, iov[i].base, iov[i].len) == 0);
+		offset += iov[i].len;
+	}
+	CHECK(ref == 1 && offset == sz);
+	// copied without the reference
+	sproto_writer_reset(w);
+	sproto_writer_reference(w, 0);
+	CHECK(sproto_encode_writer(st, w, nest_cb, &n) == sz);
+	count = sproto_writer_iov(w, iov, 16);
+	for (i=0;i<count && i<16;i++)
+		CHECK(iov[i].base != str);
+	sproto_writer_release(w);
+	sproto_binding_release(b);
+}
+
+int
+main() {
+	struct sproto * sp = sproto_create(schema, sizeof(schema));
+	if (sp == NULL) {
+		printf("invalid schema\n");
+		return 1;
+	}
+	test_bind_depth(sp);
+	test_message(sp);
+	test_decoder(sp);
+	test_packer();
+	test_writer(sp);
+	sproto_release(sp);
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
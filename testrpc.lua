@@ -100,3 +100,19 @@ print("tag =", tag)
 print_r(server_proto:request_decode("foobar", v))
 local v = server_proto:response_encode("foobar", { ok = true })
 print_r(server_proto:response_decode("foobar", v))
+
+print("=== test 3")
+-- adaptive framing, a message is packed or sent raw by the threshold
+server:framing(0, { foo = 101 })
+client:framing(0)
+local req = client_request("foobar", { what = string.rep("x", 100) }, 4)
+assert(req:byte(1) == 1)	-- raw, the string is dense
+local type, name, request, response = server:dispatch(req)
+assert(type == "REQUEST" and name == "foobar" and request.what == string.rep("x", 100))
+local type, session, response = client:dispatch(response { ok = true })
+assert(type == "RESPONSE" and session == 4 and response.ok == true)
+local type, name, request, response = server:dispatch(client_request("foo", nil, 5))
+local resp = response { ok = false }
+assert(resp:byte(1) == 1)	-- foo is never packed
+local type, session, response = client:dispatch(resp)
+assert(type == "RESPONSE" and session == 5 and response.ok == false)